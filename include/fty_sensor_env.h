@@ -28,8 +28,24 @@
 //  Add your own public definitions here, if you need them
 //#define PORTS_OFFSET                9   // T&H ports range 9-12
 #define PORTS_OFFSET                1 // consider ports 1-8 and 9-12
-#define POLLING_INTERVAL            5000
+#define POLLING_INTERVAL            5000  // default interval (ms) of T&H and GPI polling
+#define POLLING_INTERVAL_MIN        100   // shortest interval (ms) sensor may ask for
+#define POLLING_COALESCE            50    // polls due this close (ms) to each other share one cycle
+#define PRESENCE_VALIDITY           60000 // how long (ms) sensor presence probe result is trusted
+#define ABSENT_BACKOFF_MIN          10000 // first wait (ms) before empty or missing port is probed again
+#define ABSENT_BACKOFF_MAX          300000 // the wait doubles with each failed probe up to this
+#define HOTPLUG_DIR                 "/dev" // watched for serial port nodes coming and going
+#define ACQUISITION_TIMEOUT         4000  // port worker busy with a job longer (ms) is reported
+#define RECALIBRATE_AFTER           100   // good readings of port slowed down by errors before its SCK speed is calibrated again
+#define GPI_WATCH_SLICE             50    // longest wait (ms) of port worker for GPI change before it checks commands
+#define ADAPTIVE_BAND_T             10    // hundredths of C, T&H readings this close are stable
+#define ADAPTIVE_BAND_H             50    // hundredths of %
+#define ADAPTIVE_RATE_T             50    // hundredths of C per minute, faster change polls at floor interval
+#define ADAPTIVE_RATE_H             200   // hundredths of % per minute
+#define ADAPTIVE_REPORT             3600000 // ms between reports of polls saved by adaptive polling
 #define TIME_TO_LIVE                300
+#define DEADBAND_HEARTBEAT          3     // metric within its deadband is still published this many times per TTL
+#define TTL_INTERVALS               3     // metric outlives this many of its polling intervals, TIME_TO_LIVE at least
 
 #define DISABLED        0
 // temperature and humidity have negative values not to clash with GPI port range
@@ -38,6 +54,19 @@
 #define TEMPERATURE_STR "temperature"
 #define HUMIDITY_STR    "humidity"
 #define STATUSGPI_STR   "status.GPI"
+#define RESOLUTION_STR  "resolution" // asset ext attribute of T&H sensor
+#define RESOLUTION_LOW  "low"        // 12bit T, 8bit RH, about 4x faster conversions
+#define OVERSAMPLING_STR "oversampling" // asset ext attribute, T&H pairs per published reading
+#define REDUCTION_STR   "oversampling_reduction" // asset ext attribute, how the pairs are reduced
+#define REDUCTION_MEAN  "trimmed_mean" // mean without quarter of pairs at each end, median otherwise
+#define TH_INTERVAL_STR "th_interval"  // asset ext attribute of T&H sensor, ms between T&H readings
+#define GPI_INTERVAL_STR "gpi_interval" // asset ext attribute of T&H sensor, ms between readings of its GPI
+#define TEMPERATURE_DEADBAND_STR "temperature_deadband" // asset ext attribute of T&H sensor, C or % of last published
+#define HUMIDITY_DEADBAND_STR "humidity_deadband"       // asset ext attribute of T&H sensor, % RH or % of last published
+#define GPI_PUBLISH_STR "gpi_publish"   // asset ext attribute of T&H sensor, how GPI states attached to it are published
+#define GPI_PUBLISH_CHANGE "change"     // on change and as a heartbeat only, every reading otherwise
+#define GPI_MODE_STR    "gpi_mode"   // asset ext attribute of GPI sensor
+#define GPI_MODE_COUNTER "counter"   // transitions between polls are published too
 #define TH              "TH"
 #define VALID           1 // valid T&H sensor, monitored
 #define INACTIVE        2 // valid T&H sensor, not monitored (inactive), but still monitor attached GPI sensors
@@ -42,6 +42,12 @@ static const char *ACTOR_NAME = "fty-sensor-env";
 static const char *ENDPOINT = "ipc://@/malamute";
 
 static const char *config_log = "/etc/fty/ftylog.cfg";
+static const char *gpi_hold = NULL;
+static const char *th_interval = "0";
+static const char *gpi_interval = "0";
+static const char *adaptive = NULL;
+static const char *deadband = NULL;
+static bool gpi_change_only = false;
 
 static void s_signal_handler (int signal_value)
 {
@@ -78,6 +84,12 @@ int main (int argc, char *argv [])
             puts ("  --help / -h            this information");
             puts ("  --endpoint / -e        malamute endpoint [ipc://@/malamute]");
             puts ("  --config / -c          config file for logging");
+            puts ("  --gpi-watch / -g       report GPI changes stable for given ms right away");
+            puts ("  --th-interval / -t     ms between T&H readings [5000]");
+            puts ("  --gpi-interval / -i    ms between GPI readings [5000]");
+            puts ("  --adaptive / -a        poll stable T&H less often, up to given ms");
+            puts ("  --deadband / -d        publish T&H only on change over given value or %");
+            puts ("  --gpi-change / -o      publish GPI states only on change and as a heartbeat");
             return 0;
         }
         else if (streq (argv [argn], "--verbose") || streq (argv [argn], "-v")) {
@@ -91,6 +103,29 @@ int main (int argc, char *argv [])
             if (param) config_log = param;
             ++argn;
         }
+        else if (streq (argv [argn], "--gpi-watch") || streq (argv [argn], "-g")) {
+            if (param) gpi_hold = param;
+            ++argn;
+        }
+        else if (streq (argv [argn], "--th-interval") || streq (argv [argn], "-t")) {
+            if (param) th_interval = param;
+            ++argn;
+        }
+        else if (streq (argv [argn], "--gpi-interval") || streq (argv [argn], "-i")) {
+            if (param) gpi_interval = param;
+            ++argn;
+        }
+        else if (streq (argv [argn], "--adaptive") || streq (argv [argn], "-a")) {
+            if (param) adaptive = param;
+            ++argn;
+        }
+        else if (streq (argv [argn], "--deadband") || streq (argv [argn], "-d")) {
+            if (param) deadband = param;
+            ++argn;
+        }
+        else if (streq (argv [argn], "--gpi-change") || streq (argv [argn], "-o")) {
+            gpi_change_only = true;
+        }
         else {
             printf ("Unknown option: %s\n", argv [argn]);
             return 1;
@@ -110,6 +145,19 @@ int main (int argc, char *argv [])
     zstr_sendx (server, "BIND", ENDPOINT, ACTOR_NAME, NULL);
     zstr_sendx (server, "PRODUCER", FTY_PROTO_STREAM_METRICS_SENSOR, NULL);
     zstr_sendx (server, "CONSUMER", FTY_PROTO_STREAM_ASSETS, ".*", NULL);
+    if (gpi_hold) {
+        zstr_sendx (server, "GPIWATCH", gpi_hold, NULL);
+    }
+    zstr_sendx (server, "INTERVALS", th_interval, gpi_interval, NULL);
+    if (adaptive) {
+        zstr_sendx (server, "ADAPTIVE", adaptive, NULL);
+    }
+    if (deadband) {
+        zstr_sendx (server, "DEADBAND", deadband, NULL);
+    }
+    if (gpi_change_only) {
+        zstr_sendx (server, "GPICHANGE", "1", NULL);
+    }
     zstr_sendx (server, "ASKFORASSETS", NULL);
 
     while (!s_interrupted) {
@@ -37,12 +37,17 @@
 typedef struct _libth_t libth_t;
 #define LIBTH_T_DEFINED
 #endif
+#ifndef LIBTH_SIM_T_DEFINED
+typedef struct _libth_sim_t libth_sim_t;
+#define LIBTH_SIM_T_DEFINED
+#endif
 
 //  Extra headers
 
 //  Internal API
 
 #include "libth.h"
+#include "libth_sim.h"
 
 //  *** To avoid double-definitions, only define if building without draft ***
 #ifndef FTY_SENSOR_ENV_BUILD_DRAFT_API
@@ -52,6 +57,11 @@ typedef struct _libth_t libth_t;
 FTY_SENSOR_ENV_PRIVATE void
     libth_test (bool verbose);
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_SENSOR_ENV_PRIVATE void
+    libth_sim_test (bool verbose);
+
 //  Self test for private classes
 FTY_SENSOR_ENV_PRIVATE void
     fty_sensor_env_private_selftest (bool verbose, const char *subtest);
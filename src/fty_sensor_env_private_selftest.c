@@ -40,6 +40,11 @@ fty_sensor_env_private_selftest (bool verbose, const char *subtest)
 // Tests for stable private classes:
     if (streq (subtest, "$ALL") || streq (subtest, "libth_test"))
         libth_test (verbose);
+#ifdef FTY_SENSOR_ENV_BUILD_DRAFT_API
+// Tests for draft private classes:
+    if (streq (subtest, "$ALL") || streq (subtest, "libth_sim_test"))
+        libth_sim_test (verbose);
+#endif // FTY_SENSOR_ENV_BUILD_DRAFT_API
 }
 /*
 ################################################################################
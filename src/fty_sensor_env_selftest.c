@@ -43,6 +43,7 @@ all_tests [] = {
 // Tests for stable/draft private classes:
 // Now built only with --enable-drafts, so even stable builds are hidden behind the flag
     { "libth", NULL, true, false, "libth_test" },
+    { "libth_sim", NULL, false, false, "libth_sim_test" },
     { "private_classes", NULL, false, false, "$ALL" }, // compat option for older projects
 #endif // FTY_SENSOR_ENV_BUILD_DRAFT_API
 // Tests for stable public classes:
@@ -26,6 +26,11 @@
 @end
 */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
 #include "fty_sensor_env_classes.h"
 
 //  Structure of our class
@@ -33,28 +38,6 @@
 // volatile global variable
 volatile char s_interrupted = 0;
 
-// for testing
-int testing = 0;
-#ifdef __GNUC__
-    #define unlikely(x) __builtin_expect(0 != x, 0)
-#else
-    #define unlikely(x) (0 != x)
-#endif
-#define open_device(...) \
-    (unlikely(testing) ? (testing-1) : open_device(__VA_ARGS__))
-#define device_connected(...) \
-    (unlikely(testing) ? (testing-1) : device_connected(__VA_ARGS__))
-#define reset_device(...) \
-    unlikely(testing) ? (void)0 : reset_device(__VA_ARGS__)
-#define get_th_data(...) \
-    (unlikely(testing) ? 1 : get_th_data(__VA_ARGS__))
-#define compensate_temp(...) \
-    unlikely(testing) ? (void)0 : compensate_temp(__VA_ARGS__)
-#define compensate_humidity(...) \
-    unlikely(testing) ? (void)0 : compensate_humidity(__VA_ARGS__)
-#define read_gpi(...) \
-    (unlikely(testing) ? 1 : read_gpi(__VA_ARGS__))
-
 #define PORTMAP_LENGTH 12
 const char *portmapping[2][PORTMAP_LENGTH] = {
         {
@@ -72,298 +55,1878 @@ const char *portmapping[2][PORTMAP_LENGTH] = {
         }
 };
 
-typedef struct _c_item {
-    int32_t T;
-    int32_t H;
-} c_item_t;
+//  --------------------------------------------------------------------------
+//  Sampling schedule on absolute monotonic deadlines, one per sensor and
+//  metric class. Polls keep fixed cadence whatever wakes the actor and
+//  however long cycles take; a cycle overrunning following deadlines skips
+//  them instead of shifting the rest.
+
+typedef struct _poll_schedule {
+    int64_t     interval;   // ms
+    int64_t     deadline;   // when next cycle is due
+    uint64_t    cycles;     // polls run
+    uint64_t    missed;     // deadlines skipped by overrunning cycles
+} poll_schedule_t;
+
+static void
+poll_schedule_init (poll_schedule_t *schedule, int64_t interval, int64_t now)
+{
+    memset (schedule, 0, sizeof (poll_schedule_t));
+    schedule->interval = interval > 0 ? interval : 1;
+    schedule->deadline = now + schedule->interval;
+}
+
+//  Return ms left until next cycle is due, 0 if it is due already
+
+static int
+poll_schedule_wait (const poll_schedule_t *schedule, int64_t now)
+{
+    return now >= schedule->deadline ? 0 : (int) (schedule->deadline - now);
+}
+
+//  Move to next deadline after cycle finished at now, return number of
+//  deadlines missed by the cycle
+
+static unsigned int
+poll_schedule_next (poll_schedule_t *schedule, int64_t now)
+{
+    unsigned int missed = 0;
+    schedule->cycles++;
+    schedule->deadline += schedule->interval;
+    if (now >= schedule->deadline) {
+        missed = (unsigned int) ((now - schedule->deadline) / schedule->interval) + 1;
+        schedule->deadline += (int64_t) missed * schedule->interval;
+        schedule->missed += missed;
+    }
+    return missed;
+}
+
+
+//  Metric classes polled at their own intervals
+typedef enum {
+    METRIC_TH = 0,  // temperature and humidity
+    METRIC_GPI,
+    METRIC_CLASSES
+} metric_class_t;
+
+const char *metric_class_names[METRIC_CLASSES] = { "T&H", "GPI" };
+
+//  Adaptive polling of T&H. Interval doubles while readings stay in noise
+//  band, up to ceiling, and drops to the configured one on fast change.
+typedef struct _adaptive {
+    bool        valid;      // previous reading is set
+    int32_t     T, H;       // previous reading
+    int64_t     when;       // its monotonic time
+    uint64_t    polls;      // T&H polls done adaptively
+    uint64_t    span;       // ms, sum of intervals they were done at
+} adaptive_t;
+
+//  Deadband of published metric, value is published again once it leaves
+//  the band around the last published one
+typedef struct _deadband {
+    bool        enabled;    // false publishes every reading
+    int32_t     absolute;   // hundredths of the unit
+    int32_t     relative;   // hundredths of % of last published value, used if set
+} deadband_t;
+
+//  Last published value of metric
+typedef struct _published {
+    bool        valid;
+    int32_t     value;
+    int64_t     when;       // monotonic
+} published_t;
+
+//  Template of published metric, built when sensor asset or device of its
+//  port changes, so readings don't format type and subject or build aux
+typedef struct _msg_template {
+    char        *type;      // metric type, with device of the port
+    char        *subject;   // type@rack controller
+    zhash_t     *aux;       // sname, port and ext-port
+} msg_template_t;
 
 typedef struct _ext_sensor {
     char    *iname;
     char    *rack_iname;
     char    *port;
+    int     port_index; // into port table, -1 port unknown
     char    temperature;
     char    humidity;
     zhash_t *gpi;
+    zhash_t *gpi_counter;   // GPI sensors in counter mode
     char    valid;
+    bool    low_resolution; // T&H read in low resolution mode
+    unsigned int oversampling;  // T&H pairs reduced into one reading
+    th_reduction_t reduction;   // how they are reduced
+    unsigned int interval[METRIC_CLASSES];  // ms polling interval from asset, 0 default
+    unsigned int base_interval[METRIC_CLASSES];   // ms schedule was set up for
+    poll_schedule_t schedule[METRIC_CLASSES];   // adaptive polling may stretch its interval
+    adaptive_t adaptive;
+    deadband_t deadband_T;  // from asset, default one is used if not enabled
+    deadband_t deadband_H;
+    published_t published_T;
+    published_t published_H;
+    bool    gpi_change_only;    // from asset, GPI states published on change and as a heartbeat
+    zhash_t *gpi_published; // published_t of GPI inputs, by GPI port
+    msg_template_t template_T;
+    msg_template_t template_H;
+    zhash_t *gpi_template;  // msg_template_t of GPI inputs, by GPI port
+    int     due;        // metric classes polled in current cycle, bit for each
 } external_sensor_t;
 
+#define GPI_NOT_READ    -2  // GPI state could not be read, sensor not attached
+
+typedef struct _port_session {
+    libth_port_t *port; // port context, holds the opened device
+    bool    idle;       // SHT line is idle, no reset needed before next command
+    bool    calibrated; // SCK speed was calibrated for attached sensor
+    unsigned int half_period;   // us, SCK half period found by calibration
+    unsigned int slow_readings; // good readings since errors slowed SCK down
+    bool    low_resolution; // resolution wanted by sensor measured now
+    bool    resolution_set; // status register of attached sensor programmed
+    unsigned int oversampling;  // T&H pairs wanted by sensor measured now
+    th_reduction_t reduction;
+    presence_probe_t probe; // presence probe in flight
+    int     present;    // cached presence probe result
+    int64_t present_until;  // end of cached presence validity window
+    unsigned int absent_backoff;    // ms, next probe of empty port is delayed by, 0 sensor found
+    unsigned int transitions[GPI_PORTS];    // GPI transitions counted at previous job
+    bool    counted;    // transitions are valid
+} port_session_t;
+
+//  Acquisition job for one sensor. It is filled in by worker of the sensor port
+//  and handed back to the actor, which keeps ownership of it.
+typedef struct _port_job {
+    char        *iname;     // sensor being measured
+    char        *port_file; // device the sensor is attached to
+    bool        th;         // measure temperature and humidity
+    bool        low_resolution; // in low resolution mode
+    unsigned int oversampling;  // T&H pairs to reduce
+    th_reduction_t reduction;
+    bool        gpi_read;   // read and publish GPI inputs, watch them anyway
+    int         th_result;  // 0 when th_sample is valid
+    th_sample_t th_sample;
+    libth_stats_t stats;    // communication counters of the port after the job
+    size_t      gpi_count;
+    int         *gpi;       // GPI inputs to read
+    int         *gpi_state; // GPI states read, -1 invalid, GPI_NOT_READ
+    bool        *gpi_counter;       // GPI in counter mode, NULL if none is
+    int         *gpi_transitions;   // transitions since previous job, -1 unknown
+    unsigned int gpi_hold;  // ms, GPI changes stable this long are reported
+                            // by the worker right away, 0 disables it
+} port_job_t;
+
+//  GPI watch of port worker, debounces changes of GPI lines
+typedef struct _gpi_watch {
+    port_job_t  *job;       // GPI inputs watched, NULL if none
+    int         lines;      // GPI lines last confirmed, -1 unknown
+    int         pending;    // GPI lines waiting for hold time to pass
+    int64_t     pending_since;  // when pending lines were seen first
+} gpi_watch_t;
+
+//  Worker doing all the acquisition on one serial port in its own thread,
+//  so the ports are sampled in parallel
+typedef struct _port_worker {
+    zactor_t    *actor;
+    char        *port_file; // device the worker is bound to
+    zlist_t     *jobs;      // jobs dispatched and not handed back yet
+    int64_t     busy_since; // when the first of the jobs was dispatched
+    bool        used;       // port is used by some sensor in current cycle
+    int         cancel;     // cancellation token of the port, set to stop the worker fast
+} port_worker_t;
+
+//  Descriptor of port, indexed by port number minus PORTS_OFFSET
+typedef struct _port_desc {
+    char        *port_file; // device resolved for the port, NULL not resolved yet
+    port_worker_t *worker;  // NULL if no sensor uses the port
+    libth_stats_t stats;    // communication counters last reported
+} port_desc_t;
+
+void free_port_worker(void *worker);
+
+//  Entry of sampling queue. Entries are not removed when sensor is removed or
+//  rescheduled, they are dropped as stale when they come up.
+typedef struct _poll_entry {
+    int64_t     deadline;
+    char        *iname;     // sensor polled
+    metric_class_t metric;
+} poll_entry_t;
+
 //  Structure of our class
 
 struct _fty_sensor_env_server_t {
     mlm_client_t    *mlm;
-    zhash_t         *portmap;
+    port_desc_t     ports[PORTMAP_LENGTH];
     zhash_t         *gpi_env_pairing;
     zlist_t         *sensors;
+    zpoller_t       *poller;    // of the actor, workers report GPI changes to it
+    unsigned int    gpi_hold;   // ms, debounce of GPI watch, 0 polls GPI only
+    unsigned int    adaptive_ceiling;   // ms, longest adaptive T&H interval, 0 adaptive polling off
+    int64_t         adaptive_report;    // when polls saved are reported next
+    deadband_t      deadband;   // default deadband of T&H
+    bool            gpi_change_only;    // GPI states of all sensors published on change and as a heartbeat
+    unsigned int    interval[METRIC_CLASSES];   // ms, default polling intervals
+    poll_entry_t    *queue;     // binary min-heap of sampling deadlines
+    size_t          queue_size;
+    size_t          queue_alloc;
 };
 
 
+//  --------------------------------------------------------------------------
+//  Free what message template holds
+
+static void
+msg_template_clear (msg_template_t *tmpl)
+{
+    zstr_free(&(tmpl->type));
+    zstr_free(&(tmpl->subject));
+    zhash_destroy(&(tmpl->aux));
+}
+
+static void
+msg_template_destroy (void *tmpl)
+{
+    if (NULL == tmpl) return;
+    msg_template_clear((msg_template_t *) tmpl);
+    free(tmpl);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Set message template of metric type published for sensor, sname is the
+//  asset reading belongs to and ext_port GPI port of it, NULL for T&H
+
+static void
+msg_template_set (msg_template_t *tmpl, const external_sensor_t *sensor, const char *type,
+        const char *sname, const char *ext_port)
+{
+    msg_template_clear(tmpl);
+    tmpl->type = strdup(type);
+    tmpl->subject = zsys_sprintf("%s@%s", type, sensor->rack_iname);
+    tmpl->aux = zhash_new();
+    zhash_autofree(tmpl->aux);
+    if (ext_port) {
+        zhash_insert(tmpl->aux, "ext-port", (char *) ext_port);
+    }
+    zhash_insert(tmpl->aux, "sname", (char *) sname);
+    zhash_insert(tmpl->aux, "port", sensor->port);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Drop message templates of sensor
+
+static void
+sensor_templates_clear (external_sensor_t *sensor)
+{
+    msg_template_clear(&(sensor->template_T));
+    msg_template_clear(&(sensor->template_H));
+    zhash_purge(sensor->gpi_template);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Build message templates of all metrics sensor publishes from port device
+//  given, they are left empty if sensor isn't complete yet
+
+static void
+sensor_templates_build (external_sensor_t *sensor, const char *port_file)
+{
+    sensor_templates_clear(sensor);
+    if (NULL == port_file || NULL == sensor->rack_iname || NULL == sensor->port) {
+        return;
+    }
+    char *type = zsys_sprintf("%s.%s", TEMPERATURE_STR, port_file);
+    msg_template_set(&(sensor->template_T), sensor, type, sensor->iname, NULL);
+    zstr_free(&type);
+    type = zsys_sprintf("%s.%s", HUMIDITY_STR, port_file);
+    msg_template_set(&(sensor->template_H), sensor, type, sensor->iname, NULL);
+    zstr_free(&type);
+    for (char *gpi_port = (char *) zhash_first(sensor->gpi); gpi_port; gpi_port = (char *) zhash_next(sensor->gpi)) {
+        msg_template_t *tmpl = (msg_template_t *) zmalloc(sizeof(msg_template_t));
+        type = zsys_sprintf("%s%s.%s", STATUSGPI_STR, gpi_port, port_file);
+        msg_template_set(tmpl, sensor, type, zhash_cursor(sensor->gpi), gpi_port);
+        zstr_free(&type);
+        zhash_update(sensor->gpi_template, gpi_port, tmpl);
+        zhash_freefn(sensor->gpi_template, gpi_port, msg_template_destroy);
+    }
+}
+
+
 //  --------------------------------------------------------------------------
 //  Properly free a sensor
 
-void
-free_sensor(void *sensor) {
-    if (NULL == sensor) return;
-    if (((external_sensor_t *)sensor)->iname) free(((external_sensor_t *)sensor)->iname);
-    if (((external_sensor_t *)sensor)->rack_iname) free(((external_sensor_t *)sensor)->rack_iname);
-    if (((external_sensor_t *)sensor)->port) free(((external_sensor_t *)sensor)->port);
-    zhash_destroy(&(((external_sensor_t *)sensor)->gpi));
-    ((external_sensor_t *)sensor)->valid = DELETED;
-    free(sensor);
+void
+free_sensor(void *sensor) {
+    if (NULL == sensor) return;
+    if (((external_sensor_t *)sensor)->iname) free(((external_sensor_t *)sensor)->iname);
+    if (((external_sensor_t *)sensor)->rack_iname) free(((external_sensor_t *)sensor)->rack_iname);
+    if (((external_sensor_t *)sensor)->port) free(((external_sensor_t *)sensor)->port);
+    zhash_destroy(&(((external_sensor_t *)sensor)->gpi));
+    zhash_destroy(&(((external_sensor_t *)sensor)->gpi_counter));
+    zhash_destroy(&(((external_sensor_t *)sensor)->gpi_published));
+    sensor_templates_clear((external_sensor_t *)sensor);
+    zhash_destroy(&(((external_sensor_t *)sensor)->gpi_template));
+    ((external_sensor_t *)sensor)->valid = DELETED;
+    free(sensor);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new fty_sensor_env_server
+
+fty_sensor_env_server_t *
+fty_sensor_env_server_new (void)
+{
+    fty_sensor_env_server_t *self = (fty_sensor_env_server_t *) zmalloc (sizeof (fty_sensor_env_server_t));
+    assert (self);
+    //  Initialize class properties here
+    self->mlm = mlm_client_new ();
+    if (!(self->mlm)) {
+        log_error ("mlm_client_new ) failed");
+        return NULL;
+    }
+    self->gpi_env_pairing = zhash_new();
+    if (!(self->gpi_env_pairing)) {
+        log_error ("gpi_env_pairing zhash_new() failed");
+        return NULL;
+    }
+    zhash_autofree(self->gpi_env_pairing);
+    self->sensors = zlist_new ();
+    if (!(self->sensors)) {
+        log_error ("sensors zlist_new() failed");
+        return NULL;
+    }
+    for (int i = 0; i < METRIC_CLASSES; ++i) {
+        self->interval[i] = POLLING_INTERVAL;
+    }
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the fty_sensor_env_server
+
+void
+fty_sensor_env_server_destroy (fty_sensor_env_server_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        fty_sensor_env_server_t *self = *self_p;
+        //  Free class properties here
+        // all workers stop at once, not one after another, while the
+        // rest is torn down
+        for (int i = 0; i < PORTMAP_LENGTH; ++i) {
+            if (self->ports[i].worker) {
+                libth_cancel (&(self->ports[i].worker->cancel));
+            }
+        }
+        mlm_client_destroy (&(self->mlm));
+        zlist_purge(self->sensors);
+        zlist_destroy (&(self->sensors));
+        for (int i = 0; i < PORTMAP_LENGTH; ++i) {
+            free_port_worker (self->ports[i].worker);
+            free (self->ports[i].port_file);
+        }
+        zhash_destroy (&(self->gpi_env_pairing));
+        for (size_t i = 0; i < self->queue_size; ++i) {
+            free (self->queue[i].iname);
+        }
+        free (self->queue);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Free function for any mallocated variables
+
+static void
+freefn(void *var)
+{
+    if (var) free(var);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Search for a sensor in sensors list
+
+external_sensor_t *
+search_sensor(zlist_t *sensor_list, const char *iname) {
+    external_sensor_t *sensor = (external_sensor_t *) zlist_first(sensor_list);
+    while (sensor) {
+        if (0 == strcmp(sensor->iname, iname)) {
+            break;
+        }
+        sensor = (external_sensor_t *) zlist_next(sensor_list);
+    }
+    return sensor;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new sensor for sensors list
+
+external_sensor_t *
+create_sensor(const char *name, const char temperature, const char humidity, const char valid) {
+    external_sensor_t *sensor = (external_sensor_t *) malloc(sizeof(external_sensor_t));
+    if (!sensor) return NULL;
+    sensor->iname = strdup(name);
+    sensor->rack_iname = NULL;
+    sensor->port = NULL;
+    sensor->port_index = -1;
+    sensor->temperature = temperature;
+    sensor->humidity = humidity;
+    sensor->gpi = zhash_new();
+    zhash_autofree(sensor->gpi);
+    sensor->gpi_counter = zhash_new();
+    zhash_autofree(sensor->gpi_counter);
+    sensor->valid = valid;
+    sensor->low_resolution = false;
+    sensor->oversampling = 1;
+    sensor->reduction = TH_REDUCE_MEDIAN;
+    memset(sensor->interval, 0, sizeof(sensor->interval));
+    memset(sensor->base_interval, 0, sizeof(sensor->base_interval));
+    memset(sensor->schedule, 0, sizeof(sensor->schedule));
+    memset(&(sensor->adaptive), 0, sizeof(sensor->adaptive));
+    memset(&(sensor->deadband_T), 0, sizeof(sensor->deadband_T));
+    memset(&(sensor->deadband_H), 0, sizeof(sensor->deadband_H));
+    memset(&(sensor->published_T), 0, sizeof(sensor->published_T));
+    memset(&(sensor->published_H), 0, sizeof(sensor->published_H));
+    sensor->gpi_change_only = false;
+    sensor->gpi_published = zhash_new();
+    memset(&(sensor->template_T), 0, sizeof(sensor->template_T));
+    memset(&(sensor->template_H), 0, sizeof(sensor->template_H));
+    sensor->gpi_template = zhash_new();
+    sensor->due = 0;
+    return sensor;
+}
+
+
+// called with each port session created, self test attaches simulated
+// sensor by it
+static void (*s_testing_session)(port_session_t *session) = NULL;
+
+//  --------------------------------------------------------------------------
+//  Create a new session for serial port, device is opened on first use
+
+port_session_t *
+port_session_new(const char *port_file) {
+    port_session_t *session = (port_session_t *) zmalloc(sizeof(port_session_t));
+    if (!session) return NULL;
+    session->port = libth_port_new(port_file);
+    if (!session->port) {
+        free(session);
+        return NULL;
+    }
+    session->idle = false;
+    session->calibrated = false;
+    session->half_period = LIBTH_HALF_PERIOD;
+    session->slow_readings = 0;
+    session->low_resolution = false;
+    session->resolution_set = false;
+    session->oversampling = 1;
+    session->reduction = TH_REDUCE_MEDIAN;
+    session->probe.state = PRESENCE_PROBE_IDLE;
+    session->present = false;
+    session->present_until = 0;
+    session->absent_backoff = 0;
+    session->counted = false;
+    if (s_testing_session) {
+        s_testing_session(session);
+    }
+    return session;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Close device of the session, it is reopened on next use
+
+static void
+port_session_close(port_session_t *session) {
+    if (session->port->fd >= 0) {
+        close_device(session->port);
+        log_debug("Closed session of %s", session->port->path);
+    }
+    session->idle = false;
+    session->calibrated = false;
+    session->resolution_set = false;
+    session->probe.state = PRESENCE_PROBE_IDLE;
+    session->present_until = 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Properly free a session
+
+void
+free_port_session(void *session) {
+    if (NULL == session) return;
+    port_session_close((port_session_t *)session);
+    libth_port_destroy(&(((port_session_t *)session)->port));
+    free(session);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Mark the session port as empty, it is not probed again until the back
+//  off passes. Back off doubles with each empty probe.
+
+static void
+port_session_absent(port_session_t *session, int64_t now) {
+    session->absent_backoff = session->absent_backoff ? 2 * session->absent_backoff : ABSENT_BACKOFF_MIN;
+    if (session->absent_backoff > ABSENT_BACKOFF_MAX) {
+        session->absent_backoff = ABSENT_BACKOFF_MAX;
+    }
+    session->present = false;
+    session->present_until = now + session->absent_backoff;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Get presence of sensor on the session port. Result of the probe is cached
+//  for PRESENCE_VALIDITY, absence of the sensor or the device for the back off,
+//  otherwise a non-blocking probe is started or moved on. Returns
+//  PRESENCE_PENDING while the probe is in flight.
+
+static int
+port_session_presence(port_session_t *session, int64_t now) {
+    if (session->port->fd < 0) {
+        if (!session->present && now < session->present_until) {
+            // device was missing last time
+            return -1;
+        }
+        if (0 != open_device(session->port)) {
+            port_session_absent(session, now);
+            log_debug("Unable to open %s: %s, next try in %u ms", session->port->path,
+                    strerror(errno), session->absent_backoff);
+            return -1;
+        }
+        // open_device() resets the sensor
+        session->idle = true;
+    }
+    if (PRESENCE_PROBE_IDLE == session->probe.state && now < session->present_until) {
+        return session->present;
+    }
+    int connected = presence_probe_step(session->port, &(session->probe), now);
+    if (PRESENCE_PENDING == connected) {
+        return connected;
+    }
+    if (connected < 0) {
+        log_debug("Port %s failed, reopening on next use", session->port->path);
+        port_session_close(session);
+        return -1;
+    }
+    if (!connected) {
+        if (session->present) {
+            log_debug("Sensor detached from %s", session->port->path);
+        }
+        port_session_absent(session, now);
+        log_debug("No sensor attached to %s, next probe in %u ms",
+                session->port->path, session->absent_backoff);
+        return connected;
+    }
+    session->absent_backoff = 0;
+    session->present = connected;
+    session->present_until = now + PRESENCE_VALIDITY;
+    return connected;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Sensor on the session port answered, it is known to be attached for
+//  another PRESENCE_VALIDITY and healthy sensor is never probed again
+
+static void
+port_session_alive(port_session_t *session) {
+    session->present = true;
+    session->present_until = zclock_mono() + PRESENCE_VALIDITY;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Device node of the session port was added or removed, forget what is
+//  known about the port. Presence probe of added one starts right away.
+
+static void
+port_session_hotplug(port_session_t *session, bool removed, int64_t now) {
+    port_session_close(session);
+    session->absent_backoff = 0;
+    if (removed) {
+        port_session_absent(session, now);
+        return;
+    }
+    port_session_presence(session, now);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Make sure session device is opened, sensor is attached and SHT line is idle.
+//  Device is only reopened or reset after an error or a (re)attached sensor.
+//  Returns PRESENCE_PENDING while presence of the sensor is being probed.
+
+static int
+port_session_acquire(port_session_t *session) {
+    int connected = port_session_presence(session, zclock_mono());
+    if (PRESENCE_PENDING == connected) {
+        log_debug("Probing for sensor on %s", session->port->path);
+        return connected;
+    }
+    if (connected <= 0) {
+        // sensor gets reset, calibrated and programmed once it is (re)attached
+        session->idle = false;
+        session->calibrated = false;
+        session->resolution_set = false;
+        return -1;
+    }
+    if (!session->idle) {
+        reset_device(session->port);
+        session->idle = true;
+    }
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Format value kept in hundredths, without float math
+
+static void
+s_hundredths (char *buffer, int32_t value) {
+    uint32_t magnitude = value < 0 ? -(uint32_t) value : (uint32_t) value;
+    sprintf (buffer, "%s%" PRIu32 ".%02" PRIu32, value < 0 ? "-" : "",
+            magnitude / 100, magnitude % 100);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Measure temperature and humidity of sensor connected to serial port at once
+
+int
+get_th_measurement (port_session_t *session, th_sample_t *sample) {
+    if (NULL == session || NULL == sample) {
+        return -1;
+    }
+    if (0 != port_session_acquire(session)) {
+        return -1;
+    }
+    if (!session->calibrated) {
+        // failed calibration keeps default speed, it is retried on next reading
+        if (0 == libth_port_calibrate(session->port)) {
+            log_debug("Sensor on %s calibrated to half period %u us",
+                    session->port->path, session->port->half_period);
+            session->calibrated = true;
+            session->half_period = session->port->half_period;
+            session->slow_readings = 0;
+        } else {
+            log_debug("Calibration of sensor on %s failed", session->port->path);
+        }
+    }
+    if (!session->resolution_set ||
+            session->low_resolution != (bool)(session->port->status & STATUS_LOW_RES)) {
+        // readings are compensated by the mode verified in sensor, whatever it is
+        if (0 == libth_port_set_resolution(session->port, session->low_resolution)) {
+            session->resolution_set = true;
+        } else {
+            log_debug("Setting %s resolution of sensor on %s failed",
+                    session->low_resolution ? "low" : "full", session->port->path);
+        }
+    }
+    int rv = (session->oversampling > 1)
+        ? get_th_oversampled(session->port, session->oversampling, session->reduction, sample)
+        : get_th_pair(session->port, sample);
+    if (0 != rv) {
+        // line is left in unknown state, reset it before next command
+        // and check the sensor is still there, it could also be power
+        // cycled and lose its status register
+        session->idle = false;
+        session->present_until = 0;
+        session->resolution_set = false;
+        log_debug("Reading sensor '%s' failed", session->port->path);
+        return -1;
+    }
+    if (sample->count < session->oversampling) {
+        // series broke off, reading of the pairs taken so far is still good
+        session->idle = false;
+        log_debug("Only %u of %u pairs read from sensor '%s'",
+                sample->count, session->oversampling, session->port->path);
+    }
+    port_session_alive(session);
+    if (session->calibrated && session->port->half_period > session->half_period) {
+        // errors slowed SCK down, sensor talking reliably again gets its
+        // speed back by next calibration
+        if (++session->slow_readings >= RECALIBRATE_AFTER) {
+            log_debug("Sensor on %s slowed down to half period %u us, calibrating again",
+                    session->port->path, session->port->half_period);
+            session->calibrated = false;
+        }
+    }
+    char T[16], H[16];
+    s_hundredths(T, sample->T);
+    s_hundredths(H, sample->H);
+    log_debug("Got data from sensor '%s' - T = %s C, H = %s %%", session->port->path, T, H);
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Read GPI input of sensor connected to serial port.
+//  Returns GPI state, -1 if it is invalid, GPI_NOT_READ if there is no sensor
+
+int
+get_gpi_measurement (port_session_t *session, int gpi) {
+    if (NULL == session || 0 != port_session_acquire(session)) {
+        return GPI_NOT_READ;
+    }
+    int state = read_gpi(session->port, gpi);
+    if (state >= 0) {
+        port_session_alive(session);
+    }
+    return state;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Read all GPI inputs of sensor connected to serial port out of one line
+//  snapshot. Fills in state of each GPI like get_gpi_measurement does.
+
+void
+get_gpi_measurements (port_session_t *session, const int *gpi, int *state, size_t count) {
+    int lines = -1;
+    if (NULL == session || 0 != port_session_acquire(session)) {
+        for (size_t i = 0; i < count; i++) {
+            state[i] = GPI_NOT_READ;
+        }
+        return;
+    }
+    if (count > 0) {
+        lines = read_gpi_lines(session->port);
+    }
+    if (lines >= 0) {
+        port_session_alive(session);
+    }
+    for (size_t i = 0; i < count; i++) {
+        state[i] = (lines < 0) ? -1 : gpi_from_lines(lines, gpi[i]);
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Get numbers of transitions of GPI inputs in counter mode since previous
+//  call, -1 when they are unknown. First call after the counters could not
+//  be read only takes them.
+
+void
+get_gpi_transitions (port_session_t *session, const int *gpi, const bool *counter,
+        int *transitions, size_t count) {
+    unsigned int now[GPI_PORTS];
+    bool counted = false;
+    if (session && session->port->fd >= 0) {
+        counted = (0 == read_gpi_counters(session->port, now));
+    }
+    for (size_t i = 0; i < count; i++) {
+        transitions[i] = -1;
+        if (!counter[i] || !counted || !session->counted || gpi[i] < 1 || gpi[i] > GPI_PORTS) {
+            continue;
+        }
+        // unsigned difference survives wrap of the counter
+        unsigned int delta = now[gpi[i] - 1] - session->transitions[gpi[i] - 1];
+        transitions[i] = delta > INT_MAX ? INT_MAX : (int) delta;
+    }
+    if (session) {
+        session->counted = counted;
+        if (counted) {
+            memcpy(session->transitions, now, sizeof(now));
+        }
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create metric out of temperature and humidity sample
+
+fty_proto_t*
+th_metric (const char what, const th_sample_t *sample) {
+    if (NULL == sample || (TEMPERATURE != what && HUMIDITY != what)) {
+        return NULL;
+    }
+    fty_proto_t* ret = fty_proto_new (FTY_PROTO_METRIC);
+    char value[16];
+    s_hundredths (value, (TEMPERATURE == what) ? sample->T : sample->H);
+    fty_proto_set_value (ret, "%s", value);
+    if (sample->count > 1) {
+        // reduced out of more pairs, tell how much they differed
+        char samples[16];
+        s_hundredths (value, (TEMPERATURE == what) ? sample->T_spread : sample->H_spread);
+        snprintf (samples, sizeof (samples), "%u", sample->count);
+        fty_proto_aux_insert (ret, "spread", "%s", value);
+        fty_proto_aux_insert (ret, "samples", "%s", samples);
+    }
+    if (TEMPERATURE == what) {
+        fty_proto_set_unit (ret, "%s", "C");
+
+        log_debug ("Returning T = %s C", fty_proto_value (ret));
+    } else {
+        fty_proto_set_unit (ret, "%s", "%");
+
+        log_debug ("Returning H = %s %%", fty_proto_value (ret));
+    }
+    return ret;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return value GPI state is published as
+
+static const char *
+gpi_value (int gpi) {
+    if (0 == gpi) {
+        return "opened";
+    } else if (1 == gpi) {
+        return "closed";
+    }
+    return "invalid";
+}
+
+//  --------------------------------------------------------------------------
+//  Create metric out of GPI state
+
+fty_proto_t*
+gpi_metric (int gpi) {
+    if (GPI_NOT_READ == gpi) {
+        return NULL;
+    }
+    fty_proto_t* ret = fty_proto_new (FTY_PROTO_METRIC);
+    fty_proto_set_value (ret, "%s", gpi_value (gpi));
+    fty_proto_set_unit (ret, "%s", "");
+
+    log_debug ("Returning S = %s", fty_proto_value (ret));
+    return ret;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Measure sensors connected to serial port
+
+fty_proto_t*
+get_measurement (const char what, port_session_t *session) {
+    if (DISABLED == what || NULL == session) {
+        return NULL;
+    }
+    if (TEMPERATURE == what || HUMIDITY == what) {
+        th_sample_t sample;
+        if (0 != get_th_measurement(session, &sample)) {
+            return NULL;
+        }
+        return th_metric(what, &sample);
+    }
+    // port number expected
+    return gpi_metric(get_gpi_measurement(session, what));
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new acquisition job for the sensor
+
+port_job_t *
+port_job_new(external_sensor_t *sensor, const char *port_file) {
+    port_job_t *job = (port_job_t *) zmalloc(sizeof(port_job_t));
+    if (!job) return NULL;
+    job->iname = strdup(sensor->iname);
+    job->port_file = port_file ? strdup(port_file) : NULL;
+    // GPI sensors are checked regardless of their master state (both VALID and INACTIVE)
+    job->th = (VALID == sensor->valid);
+    job->low_resolution = sensor->low_resolution;
+    job->oversampling = sensor->oversampling;
+    job->reduction = sensor->reduction;
+    job->gpi_read = true;
+    job->th_result = -1;
+    job->gpi_count = zhash_size(sensor->gpi);
+    job->gpi = (int *) zmalloc((job->gpi_count + 1) * sizeof(int));
+    job->gpi_state = (int *) zmalloc((job->gpi_count + 1) * sizeof(int));
+    size_t i = 0;
+    char *sensor_gpi_port = (char *) zhash_first(sensor->gpi);
+    if (zhash_size(sensor->gpi_counter) > 0) {
+        job->gpi_counter = (bool *) zmalloc((job->gpi_count + 1) * sizeof(bool));
+        job->gpi_transitions = (int *) zmalloc((job->gpi_count + 1) * sizeof(int));
+    }
+    while (sensor_gpi_port && i < job->gpi_count) {
+        job->gpi[i] = atoi(sensor_gpi_port);
+        job->gpi_state[i] = GPI_NOT_READ;
+        if (job->gpi_counter) {
+            job->gpi_counter[i] = NULL != zhash_lookup(sensor->gpi_counter, (const char *) zhash_cursor(sensor->gpi));
+            job->gpi_transitions[i] = -1;
+        }
+        i++;
+        sensor_gpi_port = (char *) zhash_next(sensor->gpi);
+    }
+    return job;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Properly free an acquisition job
+
+void
+free_port_job(void *job) {
+    if (NULL == job) return;
+    if (((port_job_t *)job)->iname) free(((port_job_t *)job)->iname);
+    if (((port_job_t *)job)->port_file) free(((port_job_t *)job)->port_file);
+    free(((port_job_t *)job)->gpi);
+    free(((port_job_t *)job)->gpi_state);
+    free(((port_job_t *)job)->gpi_counter);
+    free(((port_job_t *)job)->gpi_transitions);
+    free(job);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Run acquisition job on the session
+
+static void
+port_job_run(port_session_t *session, port_job_t *job) {
+    if (job->th) {
+        if (s_interrupted) {
+            return;
+        }
+        session->low_resolution = job->low_resolution;
+        session->oversampling = job->oversampling;
+        session->reduction = job->reduction;
+        job->th_result = get_th_measurement(session, &(job->th_sample));
+        job->stats = session->port->stats;
+    }
+    if (s_interrupted || !job->gpi_read) {
+        return;
+    }
+    get_gpi_measurements(session, job->gpi, job->gpi_state, job->gpi_count);
+    if (job->gpi_counter) {
+        get_gpi_transitions(session, job->gpi, job->gpi_counter, job->gpi_transitions, job->gpi_count);
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Take GPI inputs to watch from the job, watch is stopped when the job
+//  has none or no hold time
+
+static void
+gpi_watch_update(gpi_watch_t *watch, const port_job_t *job) {
+    if (watch->job && job->gpi_hold == watch->job->gpi_hold &&
+            job->gpi_count == watch->job->gpi_count &&
+            0 == memcmp(job->gpi, watch->job->gpi, job->gpi_count * sizeof(int)) &&
+            streq(job->iname, watch->job->iname)) {
+        return;
+    }
+    free_port_job(watch->job);
+    watch->job = NULL;
+    watch->lines = -1;
+    if (0 == job->gpi_hold || 0 == job->gpi_count) {
+        return;
+    }
+    port_job_t *watched = (port_job_t *) zmalloc(sizeof(port_job_t));
+    watched->iname = strdup(job->iname);
+    watched->port_file = job->port_file ? strdup(job->port_file) : NULL;
+    watched->th = false;
+    watched->gpi_read = true;
+    watched->th_result = -1;
+    watched->gpi_count = job->gpi_count;
+    watched->gpi = (int *) zmalloc((job->gpi_count + 1) * sizeof(int));
+    watched->gpi_state = (int *) zmalloc((job->gpi_count + 1) * sizeof(int));
+    memcpy(watched->gpi, job->gpi, job->gpi_count * sizeof(int));
+    watched->gpi_hold = job->gpi_hold;
+    watch->job = watched;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Debounce GPI lines seen at the time. Returns true when lines changed and
+//  stayed stable for hold time since.
+
+static bool
+gpi_watch_step(gpi_watch_t *watch, int lines, int64_t now) {
+    if (lines < 0 || watch->lines < 0) {
+        // nothing to compare with, start over
+        watch->lines = watch->pending = lines;
+        return false;
+    }
+    if (lines != watch->pending) {
+        watch->pending = lines;
+        watch->pending_since = now;
+    }
+    if (watch->pending != watch->lines && now - watch->pending_since >= watch->job->gpi_hold) {
+        watch->lines = watch->pending;
+        return true;
+    }
+    return false;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Wait for change of watched GPI lines up to timeout (ms). Returns copy of
+//  the watched job with GPI states once change is confirmed, NULL otherwise.
+
+static port_job_t *
+gpi_watch_wait(port_session_t *session, gpi_watch_t *watch, int timeout) {
+    int64_t now = zclock_mono();
+    if (watch->lines >= 0 && watch->pending != watch->lines) {
+        // don't sleep past the end of the hold time
+        int64_t left = watch->pending_since + watch->job->gpi_hold - now;
+        timeout = left < timeout ? (left > 0 ? (int) left : 0) : timeout;
+    }
+    if (timeout > 0) {
+        wait_gpi(session->port, (unsigned int) timeout);
+    }
+    int lines = read_gpi_lines(session->port);
+    if (!gpi_watch_step(watch, lines, zclock_mono())) {
+        return NULL;
+    }
+    port_job_t *event = (port_job_t *) zmalloc(sizeof(port_job_t));
+    *event = *(watch->job);
+    event->iname = strdup(watch->job->iname);
+    event->port_file = watch->job->port_file ? strdup(watch->job->port_file) : NULL;
+    event->gpi = (int *) zmalloc((event->gpi_count + 1) * sizeof(int));
+    event->gpi_state = (int *) zmalloc((event->gpi_count + 1) * sizeof(int));
+    for (size_t i = 0; i < event->gpi_count; i++) {
+        event->gpi[i] = watch->job->gpi[i];
+        event->gpi_state[i] = gpi_from_lines(lines, event->gpi[i]);
+    }
+    log_debug("GPI of %s changed", session->port->path);
+    return event;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Port worker actor, owns the session of its port. Runs jobs received as
+//  ACQUIRE and hands them back as SAMPLE, moves on presence probes meanwhile.
+//  While sensor with watched GPI is attached, the worker waits for changes
+//  of GPI lines instead and sends confirmed ones as EVENT jobs. ADDED and
+//  REMOVED tell the device node of the port has changed.
+
+static void
+port_worker_actor(zsock_t *pipe, void *args) {
+    port_worker_t *worker = (port_worker_t *) args;
+    port_session_t *session = port_session_new(worker->port_file);
+    if (session) {
+        // actor cancels acquisition in progress before it stops the worker
+        libth_port_set_cancel(session->port, &(worker->cancel));
+    }
+    gpi_watch_t watch = { NULL, -1, -1, 0 };
+    zpoller_t *poller = zpoller_new (pipe, NULL);
+    zsock_signal (pipe, 0);
+    if (!session || !poller) {
+        log_error ("Unable to start worker of %s", worker->port_file);
+        zpoller_destroy (&poller);
+        free_port_session(session);
+        return;
+    }
+
+    while (!zsys_interrupted) {
+        int timeout = -1;
+        if (PRESENCE_PROBE_IDLE != session->probe.state) {
+            int64_t now = zclock_mono ();
+            timeout = session->probe.deadline > now ? (int) (session->probe.deadline - now) : 0;
+        }
+        if (watch.job && session->present && session->port->fd >= 0 && timeout != 0) {
+            // commands wait for end of the slice at most
+            if (timeout < 0 || timeout > GPI_WATCH_SLICE) {
+                timeout = GPI_WATCH_SLICE;
+            }
+            port_job_t *event = gpi_watch_wait(session, &watch, timeout);
+            if (event) {
+                zsock_send (pipe, "sp", "EVENT", event);
+            }
+            timeout = 0;
+        }
+        void *which = zpoller_wait (poller, timeout);
+        if (which == NULL) {
+            if (zpoller_terminated (poller) || zsys_interrupted) {
+                break;
+            }
+            if (PRESENCE_PROBE_IDLE != session->probe.state) {
+                port_session_presence (session, zclock_mono ());
+            }
+            continue;
+        }
+        char *cmd = NULL;
+        port_job_t *job = NULL;
+        if (0 != zsock_recv (pipe, "sp", &cmd, &job) || !cmd) {
+            break;
+        }
+        if (streq (cmd, "$TERM")) {
+            zstr_free (&cmd);
+            break;
+        }
+        else if (streq (cmd, "ACQUIRE") && job) {
+            port_job_run (session, job);
+            gpi_watch_update (&watch, job);
+            zsock_send (pipe, "sp", "SAMPLE", job);
+        }
+        else if (streq (cmd, "ADDED") || streq (cmd, "REMOVED")) {
+            port_session_hotplug (session, streq (cmd, "REMOVED"), zclock_mono ());
+        }
+        zstr_free (&cmd);
+    }
+    zpoller_destroy (&poller);
+    free_port_job (watch.job);
+    free_port_session (session);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new worker for serial port
+
+port_worker_t *
+port_worker_new(const char *port_file) {
+    port_worker_t *worker = (port_worker_t *) zmalloc(sizeof(port_worker_t));
+    if (!worker) return NULL;
+    worker->port_file = port_file ? strdup(port_file) : NULL;
+    worker->jobs = zlist_new();
+    worker->actor = zactor_new(port_worker_actor, (void *) worker);
+    if (!worker->jobs || !worker->actor) {
+        zlist_destroy(&(worker->jobs));
+        zactor_destroy(&(worker->actor));
+        free(worker->port_file);
+        free(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Properly free a worker, including the jobs it has not handed back
+
+void
+free_port_worker(void *worker) {
+    if (NULL == worker) return;
+    // acquisition in progress gives up, worker gets to $TERM right away
+    libth_cancel(&(((port_worker_t *)worker)->cancel));
+    // joins the worker thread, nobody touches the jobs afterwards
+    zactor_destroy(&(((port_worker_t *)worker)->actor));
+    port_job_t *job = (port_job_t *) zlist_first(((port_worker_t *)worker)->jobs);
+    while (job) {
+        free_port_job(job);
+        job = (port_job_t *) zlist_next(((port_worker_t *)worker)->jobs);
+    }
+    zlist_destroy(&(((port_worker_t *)worker)->jobs));
+    if (((port_worker_t *)worker)->port_file) free(((port_worker_t *)worker)->port_file);
+    free(worker);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Hotplug actor, watches directory given for serial port nodes (ttyS*,
+//  ttySTH*) and sends HOTPLUG with node name and ADDED or REMOVED for each
+//  change.
+
+static void
+hotplug_actor(zsock_t *pipe, void *args) {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd >= 0 && inotify_add_watch(fd, (const char *) args,
+                IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_ATTRIB) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        log_warning("Unable to watch %s, port changes are noticed by probes only: %s",
+                (const char *) args, strerror(errno));
+    }
+    zsock_signal (pipe, 0);
+
+    zmq_pollitem_t items [] = {
+        { zsock_resolve (pipe), 0, ZMQ_POLLIN, 0 },
+        { NULL, fd, ZMQ_POLLIN, 0 }
+    };
+    while (!zsys_interrupted) {
+        if (zmq_poll (items, fd < 0 ? 1 : 2, -1) < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            break;
+        }
+        if (items [0].revents & ZMQ_POLLIN) {
+            char *cmd = zstr_recv (pipe);
+            bool term = !cmd || streq (cmd, "$TERM");
+            zstr_free (&cmd);
+            if (term) {
+                break;
+            }
+        }
+        if (fd >= 0 && (items [1].revents & ZMQ_POLLIN)) {
+            char buffer [4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+            ssize_t length = read (fd, buffer, sizeof (buffer));
+            for (char *ptr = buffer; length > 0 && ptr < buffer + length; ) {
+                const struct inotify_event *event = (const struct inotify_event *) ptr;
+                ptr += sizeof (struct inotify_event) + event->len;
+                if (0 == event->len || 0 != strncmp (event->name, "ttyS", strlen ("ttyS"))) {
+                    continue;
+                }
+                zstr_sendx (pipe, "HOTPLUG", event->name,
+                        (event->mask & (IN_DELETE | IN_MOVED_FROM)) ? "REMOVED" : "ADDED", NULL);
+            }
+        }
+    }
+    if (fd >= 0) {
+        close (fd);
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Parse port number into index of port table, -1 if it is not a known port
+
+static int
+port_index(const char *port) {
+    if (!port || *port < '0' || *port > '9') return -1;
+    char *end = NULL;
+    errno = 0;
+    long number = strtol(port, &end, 10);
+    if (errno || *end != '\0' ||
+            number < PORTS_OFFSET || number >= PORTS_OFFSET + PORTMAP_LENGTH) {
+        return -1;
+    }
+    return (int) (number - PORTS_OFFSET);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Build message templates of sensor from device of its port in port table
+
+static void
+sensor_templates_bind(fty_sensor_env_server_t *self, external_sensor_t *sensor) {
+    bool known = sensor->port_index >= 0 && sensor->port_index < PORTMAP_LENGTH;
+    sensor_templates_build(sensor, known ? self->ports[sensor->port_index].port_file : NULL);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Resolve devices of all ports, T&H dedicated ports are symlinks which
+//  may change, standard serial ports are used as they are. Workers of
+//  remapped ports are restarted by get_port_worker(), templates of sensors
+//  on them are rebuilt right away.
+
+static void
+port_table_resolve(fty_sensor_env_server_t *self) {
+    for (int i = 0; i < PORTMAP_LENGTH; ++i) {
+        port_desc_t *desc = &(self->ports[i]);
+        char *port_file = portmapping[0][i] ? realpath (portmapping[0][i], NULL) : NULL;
+        if (!port_file) {
+            if (portmapping[0][i] && !(desc->port_file && streq(desc->port_file, portmapping[1][i]))) {
+                log_warning("Can't get realpath of %s, using %s: %s", portmapping[0][i], portmapping[1][i], strerror(errno));
+            }
+            port_file = strdup(portmapping[1][i]); // default
+        }
+        if (desc->port_file && streq(desc->port_file, port_file)) {
+            free(port_file);
+            continue;
+        }
+        if (desc->port_file) {
+            log_info("Port %d remapped from %s to %s", i + PORTS_OFFSET, desc->port_file, port_file);
+        }
+        free(desc->port_file);
+        desc->port_file = port_file;
+        memset(&(desc->stats), 0, sizeof(desc->stats));
+        for (external_sensor_t *sensor = (external_sensor_t *) zlist_first(self->sensors); sensor;
+                sensor = (external_sensor_t *) zlist_next(self->sensors)) {
+            if (sensor->port_index == i) {
+                sensor_templates_bind(self, sensor);
+            }
+        }
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Find descriptor of port served by worker actor given
+
+static port_desc_t *
+port_desc_of(fty_sensor_env_server_t *self, void *actor) {
+    for (int i = 0; i < PORTMAP_LENGTH; ++i) {
+        if (self->ports[i].worker && (void *) self->ports[i].worker->actor == actor) {
+            return &(self->ports[i]);
+        }
+    }
+    return NULL;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Pass change of port device node to worker of the port
+
+static void
+handle_hotplug(fty_sensor_env_server_t *self, const char *name, bool removed) {
+    char *path = zsys_sprintf("%s/%s", HOTPLUG_DIR, name);
+    char *real = removed ? NULL : realpath(path, NULL);
+    // ttySTH symlinks may point elsewhere now
+    port_table_resolve(self);
+    for (int i = 0; i < PORTMAP_LENGTH; ++i) {
+        port_worker_t *worker = self->ports[i].worker;
+        if (worker && worker->port_file && (streq(worker->port_file, path) ||
+                    (real && streq(worker->port_file, real)))) {
+            log_debug("Device %s %s", path, removed ? "removed" : "added");
+            zsock_send(worker->actor, "sp", removed ? "REMOVED" : "ADDED", NULL);
+        }
+    }
+    free(real);
+    zstr_free(&path);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Get worker of the port, start one if there is none yet or the port was
+//  remapped meanwhile
+
+static port_worker_t *
+get_port_worker(fty_sensor_env_server_t *self, int index) {
+    if (index < 0 || index >= PORTMAP_LENGTH) return NULL;
+    port_desc_t *desc = &(self->ports[index]);
+    port_worker_t *worker = desc->worker;
+    if (worker && (desc->port_file == worker->port_file ||
+            (desc->port_file && worker->port_file && streq(desc->port_file, worker->port_file)))) {
+        return worker;
+    }
+    if (worker) {
+        if (self->poller) {
+            zpoller_remove(self->poller, worker->actor);
+        }
+        free_port_worker(worker);
+        desc->worker = NULL;
+    }
+    worker = port_worker_new(desc->port_file);
+    if (!worker) return NULL;
+    if (self->poller) {
+        zpoller_add(self->poller, worker->actor);
+    }
+    desc->worker = worker;
+    return worker;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Add deadline to sampling queue
+
+static int
+poll_queue_push (fty_sensor_env_server_t *self, int64_t deadline, const char *iname, metric_class_t metric)
+{
+    if (self->queue_size == self->queue_alloc) {
+        size_t alloc = self->queue_alloc ? 2 * self->queue_alloc : 16;
+        poll_entry_t *queue = (poll_entry_t *) realloc (self->queue, alloc * sizeof (poll_entry_t));
+        if (!queue) {
+            log_error ("Sampling queue can't grow to %zu entries", alloc);
+            return -1;
+        }
+        self->queue = queue;
+        self->queue_alloc = alloc;
+    }
+    size_t i = self->queue_size++;
+    while (i > 0 && self->queue[(i - 1) / 2].deadline > deadline) {
+        self->queue[i] = self->queue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    self->queue[i].deadline = deadline;
+    self->queue[i].iname = strdup (iname);
+    self->queue[i].metric = metric;
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Take the earliest deadline out of sampling queue, caller owns its iname.
+//  Returns -1 if the queue is empty.
+
+static int
+poll_queue_pop (fty_sensor_env_server_t *self, poll_entry_t *entry)
+{
+    if (0 == self->queue_size) {
+        return -1;
+    }
+    *entry = self->queue[0];
+    poll_entry_t last = self->queue[--self->queue_size];
+    size_t i = 0;
+    while (2 * i + 1 < self->queue_size) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < self->queue_size && self->queue[child + 1].deadline < self->queue[child].deadline) {
+            child++;
+        }
+        if (last.deadline <= self->queue[child].deadline) {
+            break;
+        }
+        self->queue[i] = self->queue[child];
+        i = child;
+    }
+    if (self->queue_size > 0) {
+        self->queue[i] = last;
+    }
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return ms left until earliest poll is due, 0 if it is due already
+
+static int
+poll_queue_wait (fty_sensor_env_server_t *self, int64_t now)
+{
+    if (0 == self->queue_size) {
+        return POLLING_INTERVAL;
+    }
+    return now >= self->queue[0].deadline ? 0 : (int) (self->queue[0].deadline - now);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return polling interval (ms) of sensor metric class
+
+static unsigned int
+sensor_interval (fty_sensor_env_server_t *self, const external_sensor_t *sensor, metric_class_t metric)
+{
+    unsigned int interval = sensor->interval[metric] ? sensor->interval[metric] : self->interval[metric];
+    return interval < POLLING_INTERVAL_MIN ? POLLING_INTERVAL_MIN : interval;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return TTL (s) of metrics of the class, so they don't expire between polls
+
+static uint32_t
+sensor_ttl (fty_sensor_env_server_t *self, const external_sensor_t *sensor, metric_class_t metric)
+{
+    uint64_t interval = sensor_interval (self, sensor, metric);
+    if (METRIC_TH == metric && self->adaptive_ceiling > interval) {
+        interval = self->adaptive_ceiling;
+    }
+    uint32_t ttl = (uint32_t) ((interval * TTL_INTERVALS + 999) / 1000);
+    return ttl < TIME_TO_LIVE ? TIME_TO_LIVE : ttl;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Put sensors not scheduled yet and sensors with changed polling intervals
+//  in sampling queue. New sensors are polled right away.
+
+static void
+schedule_sensors (fty_sensor_env_server_t *self, int64_t now)
+{
+    external_sensor_t *sensor = (external_sensor_t *) zlist_first(self->sensors);
+    while (sensor) {
+        for (int m = 0; m < METRIC_CLASSES; ++m) {
+            unsigned int interval = sensor_interval (self, sensor, (metric_class_t) m);
+            poll_schedule_t *schedule = &(sensor->schedule[m]);
+            if (sensor->base_interval[m] == interval) {
+                continue;
+            }
+            bool scheduled = sensor->base_interval[m] > 0;
+            sensor->base_interval[m] = interval;
+            poll_schedule_init (schedule, interval, now);
+            if (METRIC_TH == m) {
+                memset (&(sensor->adaptive), 0, sizeof (sensor->adaptive));
+            }
+            if (!scheduled) {
+                schedule->deadline = now;
+            }
+            log_debug ("Polling %s of '%s' every %u ms", metric_class_names[m], sensor->iname, interval);
+            poll_queue_push (self, schedule->deadline, sensor->iname, (metric_class_t) m);
+        }
+        sensor = (external_sensor_t *) zlist_next(self->sensors);
+    }
 }
 
 
 //  --------------------------------------------------------------------------
-//  Create a new fty_sensor_env_server
+//  Adapt T&H polling interval of sensor to reading taken at now. Stable
+//  readings double the interval up to adaptive ceiling, fast change brings
+//  it back to the configured one and pulls in the next poll.
 
-fty_sensor_env_server_t *
-fty_sensor_env_server_new (void)
+static void
+adapt_th_interval (fty_sensor_env_server_t *self, external_sensor_t *sensor, const th_sample_t *sample, int64_t now)
 {
-    fty_sensor_env_server_t *self = (fty_sensor_env_server_t *) zmalloc (sizeof (fty_sensor_env_server_t));
-    assert (self);
-    //  Initialize class properties here
-    self->mlm = mlm_client_new ();
-    if (!(self->mlm)) {
-        log_error ("mlm_client_new ) failed");
-        return NULL;
+    adaptive_t *adaptive = &(sensor->adaptive);
+    poll_schedule_t *schedule = &(sensor->schedule[METRIC_TH]);
+    int64_t floor = sensor->base_interval[METRIC_TH];
+    if (0 == self->adaptive_ceiling || floor <= 0) {
+        return;
     }
-    self->portmap = zhash_new();
-    if (!(self->portmap)) {
-        log_error ("portmap zhash_new() failed");
-        return NULL;
+    int64_t interval = schedule->interval;
+    if (adaptive->valid && now > adaptive->when) {
+        int64_t elapsed = now - adaptive->when;
+        int64_t dT = llabs ((int64_t) sample->T - adaptive->T);
+        int64_t dH = llabs ((int64_t) sample->H - adaptive->H);
+        if (dT * 60000 > ADAPTIVE_RATE_T * elapsed || dH * 60000 > ADAPTIVE_RATE_H * elapsed) {
+            interval = floor;
+        } else if (dT <= ADAPTIVE_BAND_T && dH <= ADAPTIVE_BAND_H) {
+            interval = 2 * interval;
+            if (interval > (int64_t) self->adaptive_ceiling) {
+                interval = self->adaptive_ceiling > floor ? self->adaptive_ceiling : floor;
+            }
+        }
     }
-    zhash_autofree(self->portmap);
-    self->gpi_env_pairing = zhash_new();
-    if (!(self->gpi_env_pairing)) {
-        log_error ("gpi_env_pairing zhash_new() failed");
-        return NULL;
+    adaptive->valid = true;
+    adaptive->T = sample->T;
+    adaptive->H = sample->H;
+    adaptive->when = now;
+    adaptive->polls++;
+    adaptive->span += schedule->interval;
+    if (interval == schedule->interval) {
+        return;
     }
-    zhash_autofree(self->gpi_env_pairing);
-    self->sensors = zlist_new ();
-    if (!(self->sensors)) {
-        log_error ("sensors zlist_new() failed");
-        return NULL;
+    log_debug ("Polling T&H of '%s' every %" PRId64 " ms", sensor->iname, interval);
+    schedule->interval = interval;
+    if (interval == floor && now + floor < schedule->deadline) {
+        // don't wait out the long interval, previous entry becomes stale
+        schedule->deadline = now + floor;
+        poll_queue_push (self, schedule->deadline, sensor->iname, METRIC_TH);
     }
-    return self;
 }
 
 
 //  --------------------------------------------------------------------------
-//  Destroy the fty_sensor_env_server
+//  Report polls adaptive polling saved, compared to the configured intervals
 
-void
-fty_sensor_env_server_destroy (fty_sensor_env_server_t **self_p)
+static void
+report_adaptive (fty_sensor_env_server_t *self)
 {
-    assert (self_p);
-    if (*self_p) {
-        fty_sensor_env_server_t *self = *self_p;
-        //  Free class properties here
-        mlm_client_destroy (&(self->mlm));
-        zlist_purge(self->sensors);
-        zlist_destroy (&(self->sensors));
-        zhash_destroy (&(self->portmap));
-        zhash_destroy (&(self->gpi_env_pairing));
-        //  Free object itself
-        free (self);
-        *self_p = NULL;
+    external_sensor_t *sensor = (external_sensor_t *) zlist_first(self->sensors);
+    while (sensor) {
+        adaptive_t *adaptive = &(sensor->adaptive);
+        if (adaptive->polls > 0 && sensor->base_interval[METRIC_TH] > 0) {
+            uint64_t fixed = adaptive->span / sensor->base_interval[METRIC_TH];
+            uint64_t saved = fixed > adaptive->polls ? fixed - adaptive->polls : 0;
+            log_info ("T&H of '%s' polled %" PRIu64 " times instead of %" PRIu64 ", %" PRIu64 " %% saved, now every %" PRId64 " ms",
+                    sensor->iname, adaptive->polls, fixed, fixed ? 100 * saved / fixed : 0,
+                    sensor->schedule[METRIC_TH].interval);
+        }
+        sensor = (external_sensor_t *) zlist_next(self->sensors);
     }
 }
 
 
 //  --------------------------------------------------------------------------
-//  Free function for any mallocated variables
+//  Parse deadband, absolute ("0.5") or relative to last published value
+//  ("2%"). Empty one leaves deadband disabled.
 
 static void
-freefn(void *var)
+deadband_parse (const char *spec, deadband_t *band)
 {
-    if (var) free(var);
+    memset (band, 0, sizeof (deadband_t));
+    if (!spec || !*spec) {
+        return;
+    }
+    char *end = NULL;
+    double value = strtod (spec, &end);
+    if (end == spec || value < 0 || (*end && !streq (end, "%"))) {
+        log_warning ("Invalid deadband '%s', every reading is published", spec);
+        return;
+    }
+    band->enabled = true;
+    if (*end) {
+        band->relative = (int32_t) (value * 100 + 0.5);
+    } else {
+        band->absolute = (int32_t) (value * 100 + 0.5);
+    }
 }
 
 
 //  --------------------------------------------------------------------------
-//  Search for a sensor in sensors list
+//  Decide whether value read at now is published. It is when it leaves the
+//  deadband or heartbeat is due, DEADBAND_HEARTBEAT times per ttl (s).
+//  Remembers value published.
 
-external_sensor_t *
-search_sensor(zlist_t *sensor_list, const char *iname) {
-    external_sensor_t *sensor = (external_sensor_t *) zlist_first(sensor_list);
-    while (sensor) {
-        if (0 == strcmp(sensor->iname, iname)) {
-            break;
+static bool
+deadband_pass (published_t *published, const deadband_t *band, int32_t value, int64_t now, uint32_t ttl)
+{
+    if (!band->enabled) {
+        return true;
+    }
+    if (published->valid && now - published->when < (int64_t) ttl * 1000 / DEADBAND_HEARTBEAT) {
+        int64_t delta = llabs ((int64_t) value - published->value);
+        bool inside = band->relative
+            ? delta * 10000 <= (int64_t) band->relative * llabs ((int64_t) published->value)
+            : delta <= band->absolute;
+        if (inside) {
+            return false;
         }
-        sensor = (external_sensor_t *) zlist_next(sensor_list);
     }
-    return sensor;
+    published->valid = true;
+    published->value = value;
+    published->when = now;
+    return true;
 }
 
 
 //  --------------------------------------------------------------------------
-//  Create a new sensor for sensors list
+//  Decide whether GPI state read at now is published. With deadband of the
+//  sensor, only changes and heartbeats are.
 
-external_sensor_t *
-create_sensor(const char *name, const char temperature, const char humidity, const char valid) {
-    external_sensor_t *sensor = (external_sensor_t *) malloc(sizeof(external_sensor_t));
-    if (!sensor) return NULL;
-    sensor->iname = strdup(name);
-    sensor->rack_iname = NULL;
-    sensor->port = NULL;
-    sensor->temperature = temperature;
-    sensor->humidity = humidity;
-    sensor->gpi = zhash_new();
-    zhash_autofree(sensor->gpi);
-    sensor->valid = valid;
-    return sensor;
+static bool
+gpi_deadband_pass (fty_sensor_env_server_t *self, external_sensor_t *sensor, const char *gpi_port,
+        int state, bool changed, int64_t now)
+{
+    static const deadband_t change = { true, 0, 0 };
+    if (!sensor->gpi_change_only && !self->gpi_change_only) {
+        return true;
+    }
+    published_t *published = (published_t *) zhash_lookup (sensor->gpi_published, gpi_port);
+    if (!published) {
+        published = (published_t *) zmalloc (sizeof (published_t));
+        zhash_insert (sensor->gpi_published, gpi_port, published);
+        zhash_freefn (sensor->gpi_published, gpi_port, free);
+    }
+    if (changed) {
+        // pulses between polls leave the state as it was
+        published->valid = false;
+    }
+    return deadband_pass (published, &change, state, now, sensor_ttl (self, sensor, METRIC_GPI));
 }
 
 
 //  --------------------------------------------------------------------------
-//  Measure sensors connected to serial port
+//  Publish reading of sensor metric through its message template. Aux items
+//  the reading adds, key and value pairs terminated by NULL, go to a copy of
+//  template aux, the template itself is never changed.
 
-fty_proto_t*
-get_measurement (const char what, const char *port_file) {
-    if (DISABLED == what) {
-        return NULL;
+static int
+send_message(mlm_client_t *client, const msg_template_t *tmpl, const external_sensor_t *sensor,
+        const char *value, const char *unit, uint32_t ttl, const char **extra) {
+    if (NULL == client || NULL == tmpl || NULL == tmpl->subject || NULL == sensor || NULL == value) {
+        return 1;
     }
-    fty_proto_t* ret = fty_proto_new (FTY_PROTO_METRIC);
-    c_item_t data = { 0, 0 };
-
-    int fd = open_device(port_file);
-    if(!device_connected(fd)) {
-        if(fd > 0)
-            close(fd);
-        log_debug("No sensor attached to %s", port_file);
-        fty_proto_destroy (&ret);
-        return NULL;
+    zhash_t *aux = tmpl->aux;
+    if (extra && extra[0]) {
+        aux = zhash_dup(tmpl->aux);
+        for (const char **item = extra; item[0]; item += 2) {
+            zhash_update(aux, item[0], (void *) item[1]);
+        }
     }
-    else {
-        reset_device(fd);
-        if (TEMPERATURE == what) {
-            data.T = get_th_data(fd, MEASURE_TEMP);
-            compensate_temp(data.T, &data.T);
-            log_debug("Got data from sensor '%s' - T = %" PRId32 ".%02" PRId32 " C", port_file, data.T/100, data.T%100);
-
-            fty_proto_set_value (ret, "%.2f", data.T / (float) 100);
-            fty_proto_set_unit (ret, "%s", "C");
+    // codec copies aux into its own message
+    zmsg_t *to_send = fty_proto_encode_metric(aux, time (NULL), ttl ? ttl : TIME_TO_LIVE,
+            tmpl->type, sensor->rack_iname, value, unit ? unit : "");
+    if (aux != tmpl->aux) {
+        zhash_destroy(&aux);
+    }
+    if (NULL == to_send || 0 != mlm_client_send (client, tmpl->subject, &to_send)) {
+        zmsg_destroy(&to_send);
+        log_error ("mlm_client_send (subject = '%s') failed", tmpl->subject);
+        return 1;
+    }
+    return 0;
+}
 
-            log_debug ("Returning T = %s C", fty_proto_value (ret));
-        } else if (HUMIDITY == what) {
-            data.T = get_th_data(fd, MEASURE_TEMP);
-            data.H = get_th_data(fd, MEASURE_HUMI);
-            compensate_humidity(data.H, data.T, &data.H);
-            log_debug("Got data from sensor '%s' - H = %" PRId32 ".%02" PRId32 " %%", port_file, data.H/100, data.H%100);
 
-            fty_proto_set_value (ret, "%.2f", data.H / (float) 100);
-            fty_proto_set_unit (ret, "%s", "%");
+//  --------------------------------------------------------------------------
+//  Publish results of finished acquisition job
 
-            log_debug ("Returning H = %s %%", fty_proto_value (ret));
-        } else {
-            // port number expected
-            int gpi = read_gpi(fd, what);
-            if (0 == gpi) {
-                fty_proto_set_value (ret, "opened");
-            } else if (1 == gpi) {
-                fty_proto_set_value (ret, "closed");
-            } else {
-                fty_proto_set_value (ret, "invalid");
+static void
+publish_job (fty_sensor_env_server_t *self, port_job_t *job)
+{
+    external_sensor_t *sensor = search_sensor(self->sensors, job->iname);
+    if (NULL == sensor || INVALID == sensor->valid) {
+        // sensor was removed meanwhile
+        return;
+    }
+    int64_t now = zclock_mono();
+    if (job->th && 0 == job->th_result && VALID == sensor->valid) {
+        adapt_th_interval(self, sensor, &(job->th_sample), now);
+        uint32_t ttl = sensor_ttl(self, sensor, METRIC_TH);
+        char value[16], spread[16], samples[16];
+        // reduced out of more pairs, tell how much they differed
+        const char *reduced[] = { "spread", spread, "samples", samples, NULL };
+        snprintf(samples, sizeof(samples), "%u", job->th_sample.count);
+        // both metrics are published from one acquisition
+        if (deadband_pass(&(sensor->published_T), sensor->deadband_T.enabled ? &(sensor->deadband_T) : &(self->deadband),
+                job->th_sample.T, now, ttl)) {
+            s_hundredths(value, job->th_sample.T);
+            s_hundredths(spread, job->th_sample.T_spread);
+            send_message(self->mlm, &(sensor->template_T), sensor, value, "C", ttl,
+                    job->th_sample.count > 1 ? reduced : NULL);
+        }
+        if (deadband_pass(&(sensor->published_H), sensor->deadband_H.enabled ? &(sensor->deadband_H) : &(self->deadband),
+                job->th_sample.H, now, ttl)) {
+            s_hundredths(value, job->th_sample.H);
+            s_hundredths(spread, job->th_sample.H_spread);
+            send_message(self->mlm, &(sensor->template_H), sensor, value, "%", ttl,
+                    job->th_sample.count > 1 ? reduced : NULL);
+        }
+    }
+    if (!job->gpi_read) {
+        return;
+    }
+    char *sensor_gpi_port = (char *) zhash_first(sensor->gpi);
+    while (sensor_gpi_port) {
+        int sensor_gpi_port_num = atoi(sensor_gpi_port);
+        for (size_t i = 0; i < job->gpi_count; i++) {
+            if (job->gpi[i] != sensor_gpi_port_num) {
+                continue;
             }
-            fty_proto_set_unit (ret, "%s", "");
-
-            log_debug ("Returning S = %s", fty_proto_value (ret));
+            if (GPI_NOT_READ == job->gpi_state[i]) {
+                // nothing is published, deadband state is left as it was
+                break;
+            }
+            bool changed = job->gpi_transitions && job->gpi_transitions[i] > 0;
+            if (!gpi_deadband_pass(self, sensor, sensor_gpi_port, job->gpi_state[i], changed, now)) {
+                break;
+            }
+            // pulses shorter than polling period show up here only
+            char transitions[16];
+            const char *counted[] = { "transitions", transitions, "changed", changed ? "yes" : "no", NULL };
+            bool count_known = job->gpi_transitions && job->gpi_transitions[i] >= 0;
+            if (count_known) {
+                snprintf(transitions, sizeof(transitions), "%d", job->gpi_transitions[i]);
+            }
+            send_message(self->mlm, (msg_template_t *) zhash_lookup(sensor->gpi_template, sensor_gpi_port), sensor,
+                    gpi_value(job->gpi_state[i]), "", sensor_ttl(self, sensor, METRIC_GPI), count_known ? counted : NULL);
+            break;
         }
-        close(fd);
+        sensor_gpi_port = (char *) zhash_next(sensor->gpi);
     }
-    return ret;
 }
 
 
 //  --------------------------------------------------------------------------
-//  Send message containing sensor values
+//  Receive job handed back by port worker or GPI change it noticed, and
+//  publish it. Returns true for job handed back.
 
-static int
-send_message(mlm_client_t *client, fty_proto_t *msg, const external_sensor_t *sensor,
-        const char *type, const char *sname, const char *ext_port) {
-    if (NULL == client || NULL == msg || NULL == sensor || NULL == type || NULL == sname) {
-        return 1;
+static bool
+collect_job (fty_sensor_env_server_t *self, port_desc_t *desc)
+{
+    port_worker_t *worker = desc->worker;
+    char *cmd = NULL;
+    port_job_t *job = NULL;
+    bool sample = false;
+    if (0 != zsock_recv (worker->actor, "sp", &cmd, &job)) {
+        return false;
     }
-    fty_proto_set_ttl(msg, TIME_TO_LIVE);
-    fty_proto_set_name(msg, "%s", sensor->rack_iname);
-    fty_proto_set_time(msg, time (NULL));
-    fty_proto_set_type(msg, "%s", type);
-    zhash_t *aux = zhash_new();
-    zhash_autofree (aux);
-    if (ext_port) {
-        zhash_insert (aux, "ext-port", (char *)ext_port);
+    if (cmd && streq (cmd, "EVENT") && job) {
+        publish_job (self, job);
+        free_port_job (job);
     }
-    zhash_insert(aux, "sname", (char *)sname);
-    zhash_insert(aux, "port", sensor->port);
-    fty_proto_set_aux(msg, &aux);
-    char *subject = zsys_sprintf("%s@%s", type, sensor->rack_iname);
-    zmsg_t *to_send = fty_proto_encode (&msg);
-    int rv = mlm_client_send (client, subject, &to_send);
-    zstr_free(&subject);
-    fty_proto_destroy (&msg);
-    if (rv != 0) {
-        log_error ("mlm_client_send (subject = '%s') failed", subject);
-        return 1;
+    else if (cmd && streq (cmd, "SAMPLE") && job) {
+        sample = true;
+        zlist_remove (worker->jobs, job);
+        if (job->th && (job->stats.crc_errors != desc->stats.crc_errors ||
+                    job->stats.failures != desc->stats.failures)) {
+            log_warning ("Port %s: %u readings, %u CRC errors, %u retries, %u failed readings",
+                    worker->port_file, job->stats.readings, job->stats.crc_errors,
+                    job->stats.retries, job->stats.failures);
+            desc->stats = job->stats;
+        }
+        publish_job (self, job);
+        free_port_job (job);
     }
-    return 0;
+    zstr_free (&cmd);
+    return sample;
 }
 
 
 //  --------------------------------------------------------------------------
-//  Attempt to read values from sensors and publish results
+//  Hand out jobs reading sensors due to workers of their ports. All ports are
+//  sampled in parallel by the workers, results are handed back through actor
+//  pipes and published by collect_job() as they come, so the actor never
+//  waits for the slowest port.
 
 static void
 read_sensors (fty_sensor_env_server_t *self)
 {
     assert (self->mlm);
+    int64_t now = zclock_mono ();
+    schedule_sensors (self, now);
+    if (self->adaptive_ceiling && now >= self->adaptive_report) {
+        if (self->adaptive_report) {
+            report_adaptive (self);
+        }
+        self->adaptive_report = now + ADAPTIVE_REPORT;
+    }
+    // take polls due, the ones coming up shortly join them
+    poll_entry_t entry;
+    while (self->queue_size > 0 && self->queue[0].deadline <= now + POLLING_COALESCE &&
+            0 == poll_queue_pop (self, &entry)) {
+        external_sensor_t *sensor = search_sensor(self->sensors, entry.iname);
+        if (sensor && sensor->schedule[entry.metric].deadline == entry.deadline) {
+            sensor->due |= 1 << entry.metric;
+        }
+        // else sensor was removed or rescheduled meanwhile
+        free (entry.iname);
+    }
+    port_worker_t *worker = NULL;
+    for (int i = 0; i < PORTMAP_LENGTH; ++i) {
+        if (self->ports[i].worker) {
+            self->ports[i].worker->used = false;
+        }
+    }
+    // hand out jobs to the workers
     external_sensor_t *sensor = (external_sensor_t *) zlist_first(self->sensors);
     while (NULL != sensor) {
-        if (INVALID == sensor->valid) {
-            // nothing to be done for INVALID sensors
+        if (INVALID == sensor->valid || sensor->port_index < 0) {
+            // nothing to be done for INVALID sensors and unknown ports
             sensor = (external_sensor_t *) zlist_next(self->sensors);
             continue;
         }
-        const char *port_file = (char *) zhash_lookup(self->portmap, sensor->port);
-        fty_proto_t* msg = NULL;
-        if (VALID == sensor->valid) { // we measure only active sensors for T&H
-            log_debug ("Measuring '%s%s'", TH, sensor->port);
-            log_debug ("Reading from '%s'", port_file);
-            if (s_interrupted) {
-                break;
-            }
-            fty_proto_t* msg = get_measurement(TEMPERATURE, port_file);
-            if (msg) {
-                char *type = zsys_sprintf("%s.%s", TEMPERATURE_STR, port_file);
-                send_message(self->mlm, msg, sensor, type, sensor->iname, NULL);
-                zstr_free(&type);
+        if (!sensor->due) {
+            // keep worker of the port for later polls
+            if (self->ports[sensor->port_index].worker) {
+                self->ports[sensor->port_index].worker->used = true;
             }
-            if (s_interrupted) {
-                break;
+            sensor = (external_sensor_t *) zlist_next(self->sensors);
+            continue;
+        }
+        worker = get_port_worker(self, sensor->port_index);
+        if (!worker) {
+            log_error ("Unable to start worker of port '%s'", sensor->port);
+            sensor = (external_sensor_t *) zlist_next(self->sensors);
+            continue;
+        }
+        worker->used = true;
+        if (zlist_size(worker->jobs) > 0) {
+            // still busy with previous cycle, skip it
+            if (now - worker->busy_since > ACQUISITION_TIMEOUT) {
+                log_warning ("Port '%s%s' busy for %" PRId64 " ms", TH, sensor->port, now - worker->busy_since);
+            } else {
+                log_debug ("Port '%s%s' is still busy", TH, sensor->port);
             }
-            msg = get_measurement(HUMIDITY, port_file);
-            if (msg) {
-                char *type = zsys_sprintf("%s.%s", HUMIDITY_STR, port_file);
-                send_message(self->mlm, msg, sensor, type, sensor->iname, NULL);
-                zstr_free(&type);
+            sensor = (external_sensor_t *) zlist_next(self->sensors);
+            continue;
+        }
+        log_debug ("Measuring '%s%s'", TH, sensor->port);
+        log_debug ("Reading from '%s'", worker->port_file);
+        port_job_t *job = port_job_new(sensor, worker->port_file);
+        if (job) {
+            job->th = job->th && (sensor->due & (1 << METRIC_TH));
+            job->gpi_read = sensor->due & (1 << METRIC_GPI);
+            job->gpi_hold = self->gpi_hold;
+            worker->busy_since = now;
+            zlist_append(worker->jobs, job);
+            zsock_send(worker->actor, "sp", "ACQUIRE", job);
+        }
+        sensor = (external_sensor_t *) zlist_next(self->sensors);
+    }
+
+    // stop workers of ports without sensors
+    for (int i = 0; i < PORTMAP_LENGTH; ++i) {
+        worker = self->ports[i].worker;
+        if (worker && !worker->used && 0 == zlist_size(worker->jobs)) {
+            if (self->poller) {
+                zpoller_remove(self->poller, worker->actor);
             }
+            free_port_worker(worker);
+            self->ports[i].worker = NULL;
         }
-        // GPI sensors are checked regardless of their master state (both VALID and INACTIVE)
-        char *sensor_gpi_port = (char *) zhash_first(sensor->gpi);
-        while (sensor_gpi_port) {
-            int sensor_gpi_port_num = atoi(sensor_gpi_port);
-            if (s_interrupted) {
-                break;
+    }
+
+    // schedule next polls of sensors polled
+    sensor = (external_sensor_t *) zlist_first(self->sensors);
+    while (sensor) {
+        for (int m = 0; m < METRIC_CLASSES; ++m) {
+            if (!(sensor->due & (1 << m))) {
+                continue;
             }
-            msg = get_measurement(sensor_gpi_port_num, port_file);
-            if (msg) {
-                char *type = zsys_sprintf("%s%s.%s", STATUSGPI_STR, sensor_gpi_port, port_file);
-                send_message(self->mlm, msg, sensor, type, (char *) zhash_cursor(sensor->gpi), sensor_gpi_port);
-                zstr_free(&type);
+            unsigned int missed = poll_schedule_next (&(sensor->schedule[m]), now);
+            if (missed) {
+                log_warning ("Polling %s of '%s' overran, %u deadlines missed (%" PRIu64 " of %" PRIu64 " so far)",
+                        metric_class_names[m], sensor->iname, missed, sensor->schedule[m].missed,
+                        sensor->schedule[m].cycles + sensor->schedule[m].missed);
             }
-            sensor_gpi_port = (char *) zhash_next(sensor->gpi);
-        }
-        if (s_interrupted) {
-            break;
+            poll_queue_push (self, sensor->schedule[m].deadline, sensor->iname, (metric_class_t) m);
         }
+        sensor->due = 0;
         sensor = (external_sensor_t *) zlist_next(self->sensors);
     }
 }
@@ -396,6 +1959,7 @@ handle_proto_sensor(fty_sensor_env_server_t *self, zmsg_t *message) {
         const char *parent1 = fty_proto_aux_string(asset, FTY_PROTO_ASSET_AUX_PARENT_NAME_1, NULL);
         if (0 == strncmp(subtype, "sensorgpio", strlen("sensorgpio"))) {
             external_sensor_t *sensor = NULL;
+            bool counter = streq(fty_proto_ext_string(asset, GPI_MODE_STR, ""), GPI_MODE_COUNTER);
             if (parent1) {
                 sensor = (external_sensor_t *)search_sensor(self->sensors, parent1);
             } else {
@@ -414,8 +1978,11 @@ handle_proto_sensor(fty_sensor_env_server_t *self, zmsg_t *message) {
                 // simple delete
                 if (sensor) {
                     zhash_delete(sensor->gpi, name);
+                    zhash_delete(sensor->gpi_counter, name);
                     if ((0 == zhash_size(sensor->gpi)) && (VALID != sensor->valid)) {
                         zlist_remove(self->sensors, sensor);
+                    } else {
+                        sensor_templates_bind(self, sensor);
                     }
                     zhash_delete(self->gpi_env_pairing, name);
                 }
@@ -446,8 +2013,11 @@ handle_proto_sensor(fty_sensor_env_server_t *self, zmsg_t *message) {
                         external_sensor_t *previous_parent_sensor = (external_sensor_t *)search_sensor(self->sensors, previous_parent);
                         if (previous_parent_sensor && previous_parent_sensor != sensor) {
                             zhash_delete(previous_parent_sensor->gpi, name);
+                            zhash_delete(previous_parent_sensor->gpi_counter, name);
                             if ((0 == zhash_size(previous_parent_sensor->gpi)) && (VALID != previous_parent_sensor->valid)) {
                                 zlist_remove(self->sensors, previous_parent_sensor);
+                            } else {
+                                sensor_templates_bind(self, previous_parent_sensor);
                             }
                         }
                         zhash_update(self->gpi_env_pairing, name, (char *)parent1);
@@ -458,6 +2028,12 @@ handle_proto_sensor(fty_sensor_env_server_t *self, zmsg_t *message) {
                     // add GPI sensor to Sensor
                     zhash_update(sensor->gpi, name, (char *)port);
                     zhash_freefn(sensor->gpi, name, freefn);
+                    if (counter) {
+                        zhash_update(sensor->gpi_counter, name, (char *)GPI_MODE_COUNTER);
+                    } else {
+                        zhash_delete(sensor->gpi_counter, name);
+                    }
+                    sensor_templates_bind(self, sensor);
                 } else {
                     // delete gpi sensor if there was one attached to different env one
                     const char *previous_parent = (char *) zhash_lookup(self->gpi_env_pairing, name);
@@ -465,8 +2041,11 @@ handle_proto_sensor(fty_sensor_env_server_t *self, zmsg_t *message) {
                         external_sensor_t *previous_parent_sensor = (external_sensor_t *)search_sensor(self->sensors, previous_parent);
                         if (previous_parent_sensor) {
                             zhash_delete(previous_parent_sensor->gpi, name);
+                            zhash_delete(previous_parent_sensor->gpi_counter, name);
                             if ((0 == zhash_size(previous_parent_sensor->gpi)) && (VALID != previous_parent_sensor->valid)) {
                                 zlist_remove(self->sensors, previous_parent_sensor);
+                            } else {
+                                sensor_templates_bind(self, previous_parent_sensor);
                             }
                         }
                         zhash_update(self->gpi_env_pairing, name, (char *)parent1);
@@ -478,6 +2057,11 @@ handle_proto_sensor(fty_sensor_env_server_t *self, zmsg_t *message) {
                     sensor = create_sensor(parent1, DISABLED, DISABLED, INVALID);
                     zhash_update(sensor->gpi, name, (char *)port);
                     zhash_freefn(sensor->gpi, name, freefn);
+                    if (counter) {
+                        zhash_update(sensor->gpi_counter, name, (char *)GPI_MODE_COUNTER);
+                    } else {
+                        zhash_delete(sensor->gpi_counter, name);
+                    }
                     zlist_append(self->sensors, sensor);
                     zlist_freefn(self->sensors, sensor, free_sensor, true);
                 }
@@ -485,6 +2069,22 @@ handle_proto_sensor(fty_sensor_env_server_t *self, zmsg_t *message) {
         }
         else if (0 == strncmp(subtype, "sensor", strlen("sensor"))) {
             external_sensor_t *sensor = (external_sensor_t *)search_sensor(self->sensors, name);
+            bool low_resolution = streq(fty_proto_ext_string(asset, RESOLUTION_STR, ""), RESOLUTION_LOW);
+            int oversampling = atoi(fty_proto_ext_string(asset, OVERSAMPLING_STR, "1"));
+            if (oversampling < 1) {
+                oversampling = 1;
+            } else if (oversampling > LIBTH_MAX_OVERSAMPLING) {
+                oversampling = LIBTH_MAX_OVERSAMPLING;
+            }
+            th_reduction_t reduction = streq(fty_proto_ext_string(asset, REDUCTION_STR, ""), REDUCTION_MEAN)
+                ? TH_REDUCE_TRIMMED_MEAN : TH_REDUCE_MEDIAN;
+            // zero or garbage leaves default interval
+            int th_interval = atoi(fty_proto_ext_string(asset, TH_INTERVAL_STR, "0"));
+            int gpi_interval = atoi(fty_proto_ext_string(asset, GPI_INTERVAL_STR, "0"));
+            deadband_t deadband_T, deadband_H;
+            deadband_parse(fty_proto_ext_string(asset, TEMPERATURE_DEADBAND_STR, NULL), &deadband_T);
+            deadband_parse(fty_proto_ext_string(asset, HUMIDITY_DEADBAND_STR, NULL), &deadband_H);
+            bool gpi_change_only = streq(fty_proto_ext_string(asset, GPI_PUBLISH_STR, ""), GPI_PUBLISH_CHANGE);
             if (streq (operation, FTY_PROTO_ASSET_OP_DELETE) ||
                     streq (operation, FTY_PROTO_ASSET_OP_RETIRE) ||
                     !streq(fty_proto_aux_string (asset, FTY_PROTO_ASSET_STATUS, "active"), "active")) {
@@ -530,16 +2130,36 @@ handle_proto_sensor(fty_sensor_env_server_t *self, zmsg_t *message) {
                             sensor->port = strdup(port);
                         }
                     }
+                    sensor->port_index = port_index(port);
                     sensor->temperature = TEMPERATURE;
                     sensor->humidity = HUMIDITY;
+                    sensor->low_resolution = low_resolution;
+                    sensor->oversampling = oversampling;
+                    sensor->reduction = reduction;
+                    sensor->interval[METRIC_TH] = th_interval > 0 ? (unsigned int) th_interval : 0;
+                    sensor->interval[METRIC_GPI] = gpi_interval > 0 ? (unsigned int) gpi_interval : 0;
+                    sensor->deadband_T = deadband_T;
+                    sensor->deadband_H = deadband_H;
+                    sensor->gpi_change_only = gpi_change_only;
                 } else {
                     // brand new sensor, just create it
                     sensor = create_sensor(name, TEMPERATURE, HUMIDITY, VALID);
                     sensor->rack_iname = strdup(parent1);
                     sensor->port = strdup(port);
+                    sensor->port_index = port_index(port);
+                    sensor->low_resolution = low_resolution;
+                    sensor->oversampling = oversampling;
+                    sensor->reduction = reduction;
+                    sensor->interval[METRIC_TH] = th_interval > 0 ? (unsigned int) th_interval : 0;
+                    sensor->interval[METRIC_GPI] = gpi_interval > 0 ? (unsigned int) gpi_interval : 0;
+                    sensor->deadband_T = deadband_T;
+                    sensor->deadband_H = deadband_H;
+                    sensor->gpi_change_only = gpi_change_only;
                     zlist_append(self->sensors, sensor);
                     zlist_freefn(self->sensors, sensor, free_sensor, true);
                 }
+                // metrics are published through templates, only this sensor changed
+                sensor_templates_bind(self, sensor);
             }
         }
     }
@@ -553,7 +2173,7 @@ handle_proto_sensor(fty_sensor_env_server_t *self, zmsg_t *message) {
 //
 void
 sensor_env_actor(zsock_t *pipe, void *args) {
-    int i, rv;
+    int rv;
     fty_sensor_env_server_t *self = fty_sensor_env_server_new();
     assert (self);
     zsock_signal (pipe, 0);
@@ -564,38 +2184,27 @@ sensor_env_actor(zsock_t *pipe, void *args) {
         log_error ("zpoller_new () failed");
         return;
     }
-
-    log_info ("Initializing device real paths.");
-    for (i = 0; i < PORTMAP_LENGTH; ++i) {
-        char *patha = realpath (portmapping[0][i], NULL);
-        char *key = zsys_sprintf("%d", i + PORTS_OFFSET);
-        if (patha) {
-            zhash_insert(self->portmap, key, patha); // real link name
-            zhash_freefn(self->portmap, key, freefn);
-        } else {
-            log_warning("Can't get realpath of %s, using %s: %s", portmapping[0][i], portmapping[1][i], strerror(errno));
-            zhash_insert(self->portmap, key, (char *)portmapping[1][i]); // default
-            zhash_freefn(self->portmap, key, freefn);
-        }
-        zstr_free(&key);
+    self->poller = poller;
+    zactor_t *hotplug = zactor_new (hotplug_actor, (void *) HOTPLUG_DIR);
+    if (hotplug) {
+        zpoller_add (poller, hotplug);
     }
 
+    log_info ("Initializing device real paths.");
+    port_table_resolve (self);
     log_info ("Device real paths initiated.");
-    uint64_t timestamp = (uint64_t) zclock_mono ();
-    uint64_t timeout = (uint64_t) POLLING_INTERVAL;
 
     while (1) {
         log_trace ("cycle ... ");
-        void *which = zpoller_wait (poller, timeout);
+        if (0 == poll_queue_wait (self, zclock_mono ())) {
+            read_sensors (self);
+        }
+        void *which = zpoller_wait (poller, poll_queue_wait (self, zclock_mono ()));
         if (which == NULL) {
             if (zpoller_terminated (poller) || zsys_interrupted) {
                 log_info("server: zpoller terminated or zsys_interrupted");
                 break;
             }
-            if (zpoller_expired (poller)) {
-                read_sensors (self);
-            }
-            timestamp = (uint64_t) zclock_mono ();
             continue;
         }
         else if (which == pipe) {
@@ -652,6 +2261,53 @@ sensor_env_actor(zsock_t *pipe, void *args) {
                     zstr_free (&stream);
                     zstr_free (&pattern);
                 }
+                else if (streq (cmd, "INTERVALS")) {
+                    char *th_interval = zmsg_popstr (msg);
+                    char *gpi_interval = zmsg_popstr (msg);
+                    if (th_interval && atoi (th_interval) > 0) {
+                        self->interval[METRIC_TH] = (unsigned int) atoi (th_interval);
+                    }
+                    if (gpi_interval && atoi (gpi_interval) > 0) {
+                        self->interval[METRIC_GPI] = (unsigned int) atoi (gpi_interval);
+                    }
+                    log_info ("Polling T&H every %u ms, GPI every %u ms",
+                            self->interval[METRIC_TH], self->interval[METRIC_GPI]);
+                    schedule_sensors (self, zclock_mono ());
+                    zstr_free (&gpi_interval);
+                    zstr_free (&th_interval);
+                }
+                else if (streq (cmd, "ADAPTIVE")) {
+                    char *ceiling = zmsg_popstr (msg);
+                    self->adaptive_ceiling = ceiling && atoi (ceiling) > 0 ? (unsigned int) atoi (ceiling) : 0;
+                    if (self->adaptive_ceiling) {
+                        log_info ("Adaptive T&H polling, up to every %u ms", self->adaptive_ceiling);
+                    }
+                    zstr_free (&ceiling);
+                }
+                else if (streq (cmd, "DEADBAND")) {
+                    char *deadband = zmsg_popstr (msg);
+                    deadband_parse (deadband, &(self->deadband));
+                    if (self->deadband.enabled) {
+                        log_info ("T&H published on leaving deadband %s", deadband);
+                    }
+                    zstr_free (&deadband);
+                }
+                else if (streq (cmd, "GPICHANGE")) {
+                    char *change_only = zmsg_popstr (msg);
+                    self->gpi_change_only = change_only && streq (change_only, "1");
+                    if (self->gpi_change_only) {
+                        log_info ("GPI states published on change and as a heartbeat");
+                    }
+                    zstr_free (&change_only);
+                }
+                else if (streq (cmd, "GPIWATCH")) {
+                    char *hold = zmsg_popstr (msg);
+                    self->gpi_hold = hold ? (unsigned int) atoi (hold) : 0;
+                    if (self->gpi_hold) {
+                        log_info ("Watching GPI changes, hold time %u ms", self->gpi_hold);
+                    }
+                    zstr_free (&hold);
+                }
                 else if (streq(cmd, "ASKFORASSETS")) {
                     log_debug("Asking for assets");
                     zmsg_t *republish = zmsg_new ();
@@ -668,29 +2324,75 @@ sensor_env_actor(zsock_t *pipe, void *args) {
             }
             zmsg_destroy (&msg);
         }
-        else {
-            uint64_t now = (uint64_t) zclock_mono ();
-            if (now - timestamp >= timeout) {
-                read_sensors (self);
-                timestamp = (uint64_t) zclock_mono ();
+        else if (hotplug && which == hotplug) {
+            zmsg_t *msg = zmsg_recv (hotplug);
+            char *cmd = zmsg_popstr (msg);
+            char *name = zmsg_popstr (msg);
+            char *change = zmsg_popstr (msg);
+            if (cmd && name && change && streq (cmd, "HOTPLUG")) {
+                handle_hotplug (self, name, streq (change, "REMOVED"));
+            }
+            zstr_free (&change);
+            zstr_free (&name);
+            zstr_free (&cmd);
+            zmsg_destroy (&msg);
+        }
+        else if (which != mlm_client_msgpipe (self->mlm)) {
+            // job handed back or GPI change noticed by port worker
+            port_desc_t *desc = port_desc_of (self, which);
+            if (desc) {
+                collect_job (self, desc);
             }
+        }
+        else {
             zmsg_t *msg = mlm_client_recv (self->mlm);
             if (!msg)
                 break;
 
             handle_proto_sensor(self, msg);
             // zmsg_destroy (&msg); // called within handle_proto_sensor->fty_proto_decode
+            schedule_sensors (self, zclock_mono ());
         }
     }
     log_info("server: about to quit");
 
     zpoller_destroy (&poller);
+    zactor_destroy (&hotplug);
+    self->poller = NULL;
     fty_sensor_env_server_destroy(&self);
     log_info("server: finished");
     return;
 }
 
 
+#ifdef FTY_SENSOR_ENV_BUILD_DRAFT_API
+//  --------------------------------------------------------------------------
+//  Self test serves ports of all sessions by one simulated sensor, which is
+//  taken as present. Simulator is built with draft API only, it is not
+//  shipped in release library
+
+static libth_sim_t *s_testing_sim = NULL;
+
+static void
+s_testing_attach_sim(port_session_t *session) {
+    libth_sim_attach(s_testing_sim, session->port);
+    session->present = true;
+    session->present_until = zclock_mono() + PRESENCE_VALIDITY;
+}
+
+//  Run presence probe of the session to its end, time moves on by probe steps
+
+static int
+s_testing_presence(port_session_t *session, int64_t *now) {
+    int connected;
+    while (PRESENCE_PENDING == (connected = port_session_presence(session, *now))) {
+        *now += PRESENCE_PROBE_STEP;
+    }
+    return connected;
+}
+#endif // FTY_SENSOR_ENV_BUILD_DRAFT_API
+
+
 //  --------------------------------------------------------------------------
 //  Self test of this class
 
@@ -699,7 +2401,6 @@ fty_sensor_env_server_test (bool verbose)
 {
 
     printf (" * fty_sensor_env_server: ");
-    testing = 1;
 
     //  @selftest
     //  Simple create/destroy test
@@ -723,7 +2424,7 @@ fty_sensor_env_server_test (bool verbose)
     fty_sensor_env_server_t *self = fty_sensor_env_server_new ();
     assert(self);
     assert(self->mlm);
-    assert(self->portmap);
+    assert(!self->ports[0].worker);
     assert(self->sensors);
     mlm_client_connect (self->mlm, "ipc://@/malamute", 1000, "fty-sensor-env");
     mlm_client_set_producer (self->mlm, FTY_PROTO_STREAM_METRICS_SENSOR);
@@ -803,58 +2504,429 @@ fty_sensor_env_server_test (bool verbose)
     zlist_purge(self->sensors);
     // ===== /sensors =============================================================================
 
+    // ===== port sessions ========================================================================
+#ifdef FTY_SENSOR_ENV_BUILD_DRAFT_API
+    s_testing_sim = libth_sim_new();
+    libth_sim_set_timing(s_testing_sim, 0, 0, 1);
+    s_testing_session = s_testing_attach_sim;
+    port_session_t *session = port_session_new("dummy");
+    assert(session);
+    assert(streq(session->port->path, "dummy"));
+    assert(-1 == session->port->fd); // verify device is opened on first use only
+    assert(0 == port_session_acquire(session)); // verify session gets opened
+    int fd = session->port->fd;
+    assert(fd >= 0);
+    assert(session->idle);
+    session->idle = false;
+    assert(0 == port_session_acquire(session)); // verify session is reused and line reset
+    assert(fd == session->port->fd);
+    assert(session->idle);
+    libth_sim_set_present(s_testing_sim, true, false); // sensor gets detached
+    assert(0 == port_session_acquire(session)); // verify presence is cached
+    session->present_until = 0;
+    int64_t probe_time = zclock_mono();
+    assert(0 == s_testing_presence(session, &probe_time)); // verify detached sensor is found once cache expires
+    assert(0 != port_session_acquire(session));
+    assert(!session->idle);
+    libth_sim_set_present(s_testing_sim, true, true);
+    assert(0 != port_session_acquire(session)); // verify absence is cached too
+    session->present_until = 0;
+    probe_time = zclock_mono();
+    assert(1 == s_testing_presence(session, &probe_time));
+    assert(0 == port_session_acquire(session)); // verify reattached sensor gets reset
+    assert(session->idle);
+    assert(!session->calibrated);
+    th_sample_t calibration_sample;
+    assert(0 == get_th_measurement(session, &calibration_sample));
+    assert(session->calibrated); // verify sensor is calibrated on first read
+    assert(session->resolution_set);
+    assert(0 == (session->port->status & STATUS_LOW_RES));
+    session->low_resolution = true;
+    assert(0 == get_th_measurement(session, &calibration_sample));
+    assert(session->port->status & STATUS_LOW_RES); // verify resolution follows the sensor
+    session->low_resolution = false;
+    assert(0 == get_th_measurement(session, &calibration_sample));
+    assert(0 == (session->port->status & STATUS_LOW_RES));
+    port_session_t *session_fail = port_session_new("fail");
+    assert(session_fail);
+    // empty port is probed less and less often
+    libth_sim_set_present(s_testing_sim, true, false);
+    port_session_t *session_empty = port_session_new("empty");
+    session_empty->present = false;
+    session_empty->present_until = 0;
+    probe_time = zclock_mono();
+    assert(0 == s_testing_presence(session_empty, &probe_time));
+    assert(ABSENT_BACKOFF_MIN == session_empty->absent_backoff);
+    assert(0 == port_session_presence(session_empty, probe_time + ABSENT_BACKOFF_MIN - 1));
+    assert(ABSENT_BACKOFF_MIN == session_empty->absent_backoff); // verify absence is not probed during back off
+    unsigned int backoff = ABSENT_BACKOFF_MIN;
+    while (backoff < ABSENT_BACKOFF_MAX) {
+        probe_time += backoff;
+        assert(0 == s_testing_presence(session_empty, &probe_time));
+        backoff = backoff * 2 < ABSENT_BACKOFF_MAX ? backoff * 2 : ABSENT_BACKOFF_MAX;
+        assert(backoff == session_empty->absent_backoff); // verify back off doubles up to maximum
+    }
+    libth_sim_set_present(s_testing_sim, true, true);
+    probe_time++;
+    port_session_hotplug(session_empty, false, probe_time); // verify added device is probed right away
+    assert(0 == session_empty->absent_backoff);
+    assert(PRESENCE_PROBE_IDLE != session_empty->probe.state && session_empty->port->fd >= 0);
+    assert(1 == s_testing_presence(session_empty, &probe_time));
+    assert(session_empty->present);
+    port_session_hotplug(session_empty, true, probe_time + 2); // verify removed device is closed and not opened
+    assert(-1 == session_empty->port->fd && !session_empty->present);
+    assert(-1 == port_session_presence(session_empty, probe_time + 3));
+    assert(-1 == session_empty->port->fd);
+    free_port_session(session_empty);
+    // readings are reduced and kept in the session
+    port_session_t *session_sim = port_session_new("sim");
+    session_sim->low_resolution = true;
+    th_sample_t sim_sample;
+    assert(0 == get_th_measurement(session_sim, &sim_sample));
+    assert(session_sim->calibrated && session_sim->resolution_set);
+    assert(session_sim->port->half_period < LIBTH_HALF_PERIOD);
+    assert(session_sim->port->status & STATUS_LOW_RES);
+    assert(abs(sim_sample.T - 2500) <= 4);
+    assert(1 == sim_sample.count);
+    session_sim->oversampling = 3; // verify pairs are reduced in one session
+    unsigned int sim_conversions = libth_sim_conversions(s_testing_sim);
+    assert(0 == get_th_measurement(session_sim, &sim_sample));
+    assert(3 == sim_sample.count && 0 == sim_sample.T_spread);
+    assert(sim_conversions + 6 == libth_sim_conversions(s_testing_sim));
+    session_sim->oversampling = 1;
+    unsigned int sim_half_period = session_sim->port->half_period;
+    libth_port_backoff(session_sim->port); // verify port slowed down by errors gets calibrated again
+    assert(0 == get_th_measurement(session_sim, &sim_sample));
+    assert(session_sim->calibrated && 1 == session_sim->slow_readings);
+    session_sim->slow_readings = RECALIBRATE_AFTER - 1;
+    assert(0 == get_th_measurement(session_sim, &sim_sample));
+    assert(!session_sim->calibrated);
+    assert(0 == get_th_measurement(session_sim, &sim_sample));
+    assert(session_sim->calibrated && sim_half_period == session_sim->port->half_period);
+    assert(0 == session_sim->slow_readings);
+    session_sim->present_until = zclock_mono() + 1; // verify good readings keep presence valid
+    assert(0 == get_th_measurement(session_sim, &sim_sample));
+    zclock_sleep(5);
+    assert(0 == get_th_measurement(session_sim, &sim_sample)); // no probe skips the cycle
+    assert(PRESENCE_PROBE_IDLE == session_sim->probe.state);
+    assert(session_sim->present_until > zclock_mono() + PRESENCE_VALIDITY / 2);
+    libth_sim_set_gpi(s_testing_sim, 2, 1);
+    assert(1 == get_gpi_measurement(session_sim, 2));
+    assert(0 == get_gpi_measurement(session_sim, 1));
+    int sim_gpi[] = { 2, 1, 3 }; // verify all GPI come from one read
+    int sim_gpi_state[3];
+    get_gpi_measurements(session_sim, sim_gpi, sim_gpi_state, 3);
+    assert(1 == sim_gpi_state[0] && 0 == sim_gpi_state[1] && -1 == sim_gpi_state[2]);
+    // GPI watch reports changes stable for hold time only
+    sensor = create_sensor("sim sensor", TEMPERATURE, HUMIDITY, VALID);
+    zhash_update(sensor->gpi, "sim gpi 2", "2");
+    port_job_t *watch_job = port_job_new(sensor, "sim");
+    // pulses between two polls are counted
+    bool sim_counter[] = { true, false, true };
+    int sim_transitions[3];
+    get_gpi_transitions(session_sim, sim_gpi, sim_counter, sim_transitions, 3);
+    assert(-1 == sim_transitions[0] && -1 == sim_transitions[1]); // verify first poll only takes counters
+    libth_sim_set_gpi(s_testing_sim, 2, 0);
+    libth_sim_set_gpi(s_testing_sim, 2, 1);
+    libth_sim_set_gpi(s_testing_sim, 1, 1);
+    get_gpi_transitions(session_sim, sim_gpi, sim_counter, sim_transitions, 3);
+    assert(2 == sim_transitions[0]);
+    assert(-1 == sim_transitions[1] && -1 == sim_transitions[2]); // verify only GPI in counter mode are counted
+    get_gpi_transitions(session_sim, sim_gpi, sim_counter, sim_transitions, 3);
+    assert(0 == sim_transitions[0]);
+    gpi_watch_t watch = { NULL, -1, -1, 0 };
+    gpi_watch_update(&watch, watch_job);
+    assert(NULL == watch.job); // verify there is no watch without hold time
+    watch_job->gpi_hold = 20;
+    gpi_watch_update(&watch, watch_job);
+    assert(watch.job && watch.job != watch_job && 20 == watch.job->gpi_hold);
+    assert(NULL == gpi_watch_wait(session_sim, &watch, 0)); // verify first lines are taken as they are
+    libth_sim_set_gpi(s_testing_sim, 2, 0);
+    assert(NULL == gpi_watch_wait(session_sim, &watch, 0)); // verify change is held
+    int64_t hold_start = zclock_mono();
+    port_job_t *event = gpi_watch_wait(session_sim, &watch, 1000);
+    assert(event); // verify wait ends with the hold time
+    assert(zclock_mono() - hold_start < 500);
+    assert(!event->th && 1 == event->gpi_count && 2 == event->gpi[0] && 0 == event->gpi_state[0]);
+    assert(streq(event->iname, "sim sensor"));
+    free_port_job(event);
+    libth_sim_set_gpi(s_testing_sim, 2, 1);
+    assert(NULL == gpi_watch_wait(session_sim, &watch, 0));
+    libth_sim_set_gpi(s_testing_sim, 2, 0); // verify bounce shorter than hold time is not reported
+    assert(NULL == gpi_watch_wait(session_sim, &watch, 30));
+    assert(NULL == gpi_watch_wait(session_sim, &watch, 0));
+    gpi_watch_update(&watch, watch_job); // verify same job keeps the watch
+    assert(watch.lines >= 0);
+    watch_job->gpi_hold = 0;
+    gpi_watch_update(&watch, watch_job);
+    assert(NULL == watch.job);
+    free_port_job(watch_job);
+    free_sensor(sensor);
+    libth_sim_set_faults(s_testing_sim, 0, 1); // sensor stops acknowledging
+    session_sim->calibrated = false;
+    assert(0 != get_th_measurement(session_sim, &sim_sample));
+    assert(!session_sim->calibrated); // verify failed calibration is retried
+    assert(!session_sim->idle && !session_sim->resolution_set);
+    free_port_session(session_sim);
+    libth_sim_set_faults(s_testing_sim, 0, 0);
+    free_port_session(session);
+#endif // FTY_SENSOR_ENV_BUILD_DRAFT_API
+    // ===== /port sessions =======================================================================
+
     // ===== get_measurement function =============================================================
-    testing = 2; // sets file open to pass
-    fty_proto_t* msg = get_measurement(TEMPERATURE, "dummy"); // verify temperature works fine
+    fty_proto_t* msg = NULL;
+#ifdef FTY_SENSOR_ENV_BUILD_DRAFT_API
+    libth_sim_set_raw(s_testing_sim, 4011, 1000); // 0.01 C
+    int32_t sim_H;
+    compensate_humidity(1000, 1, false, &sim_H);
+    char sim_H_value[16];
+    s_hundredths(sim_H_value, sim_H);
+    libth_sim_set_gpi(s_testing_sim, 1, 1);
+    session = port_session_new("dummy"); // sensor was left in error by the last session, this one resets it
+    msg = get_measurement(TEMPERATURE, session); // verify temperature works fine
     assert(msg);
     assert(FTY_PROTO_METRIC == fty_proto_id(msg));
     assert(streq(fty_proto_value(msg),"0.01"));
     assert(streq(fty_proto_unit(msg),"C"));
     fty_proto_destroy(&msg);
-    msg = get_measurement(HUMIDITY, "dummy"); // verify humidity works fine
+    msg = get_measurement(HUMIDITY, session); // verify humidity works fine
     assert(msg);
     assert(FTY_PROTO_METRIC == fty_proto_id(msg));
-    assert(streq(fty_proto_value(msg),"0.01"));
+    assert(streq(fty_proto_value(msg),sim_H_value));
     assert(streq(fty_proto_unit(msg),"%"));
     fty_proto_destroy(&msg);
-    msg = get_measurement(1, "dummy"); // verify gpi works fine
+    msg = get_measurement(1, session); // verify gpi works fine
     assert(msg);
     assert(FTY_PROTO_METRIC == fty_proto_id(msg));
     assert(streq(fty_proto_value(msg),"closed"));
     assert(streq(fty_proto_unit(msg),""));
     fty_proto_destroy(&msg);
-    msg = get_measurement(DISABLED, "dummy"); // verify disabled check returns NULL
+    msg = get_measurement(DISABLED, session); // verify disabled check returns NULL
     assert(NULL == msg);
-    testing = 1; // sets file open to fail
-    msg = get_measurement(HUMIDITY, "fail"); // verify measurement returns NULL when file open fails
+    th_sample_t sample;
+    assert(0 == get_th_measurement(session, &sample)); // verify temperature and humidity are read at once
+    assert(1 == sample.T && sim_H == sample.H);
+    msg = th_metric(HUMIDITY, &sample); // verify both metrics can be built from one sample
+    assert(msg);
+    assert(streq(fty_proto_value(msg),sim_H_value));
+    assert(streq(fty_proto_unit(msg),"%"));
+    fty_proto_destroy(&msg);
+    msg = th_metric(TEMPERATURE, &sample);
+    assert(msg);
+    assert(streq(fty_proto_value(msg),"0.01"));
+    assert(streq(fty_proto_unit(msg),"C"));
+    fty_proto_destroy(&msg);
+    libth_sim_set_present(s_testing_sim, false, false); // device can't be opened
+    msg = get_measurement(HUMIDITY, session_fail); // verify measurement returns NULL when file open fails
     assert(NULL == msg);
-    testing = 2; // sets file open to pass
+    free_port_session(session_fail);
+    libth_sim_set_present(s_testing_sim, true, true);
+    free_port_session(session);
+#endif // FTY_SENSOR_ENV_BUILD_DRAFT_API
+    th_sample_t negative_sample = { 0, 0, -1005, 5, 1, 0, 0 }; // verify negative values keep their sign
+    msg = th_metric(TEMPERATURE, &negative_sample);
+    assert(streq(fty_proto_value(msg),"-10.05"));
+    fty_proto_destroy(&msg);
+    negative_sample.T = -5;
+    msg = th_metric(TEMPERATURE, &negative_sample);
+    assert(streq(fty_proto_value(msg),"-0.05"));
+    fty_proto_destroy(&msg);
+    msg = th_metric(HUMIDITY, &negative_sample);
+    assert(streq(fty_proto_value(msg),"0.05"));
+    assert(NULL == fty_proto_aux_string(msg, "spread", NULL)); // verify single pair has no spread
+    fty_proto_destroy(&msg);
+    th_sample_t reduced_sample = { 0, 0, 2512, 4870, 5, 37, 110 }; // verify spread of reduced pairs
+    msg = th_metric(TEMPERATURE, &reduced_sample);
+    assert(streq(fty_proto_value(msg),"25.12"));
+    assert(streq(fty_proto_aux_string(msg, "spread", ""),"0.37"));
+    assert(streq(fty_proto_aux_string(msg, "samples", ""),"5"));
+    fty_proto_destroy(&msg);
+    msg = th_metric(HUMIDITY, &reduced_sample);
+    assert(streq(fty_proto_aux_string(msg, "spread", ""),"1.10"));
+    fty_proto_destroy(&msg);
+    assert(NULL == th_metric(1, &negative_sample)); // verify GPI can't be built from sample
     // ===== /get_measurement function ============================================================
 
+    // ===== port workers =========================================================================
+    assert(0 == port_index("1")); // verify ports are parsed into table indices
+    assert(PORTMAP_LENGTH - 1 == port_index("12"));
+    assert(-1 == port_index("0"));
+    assert(-1 == port_index("13"));
+    assert(-1 == port_index("51"));
+    assert(-1 == port_index("1a"));
+    assert(-1 == port_index("-1"));
+    assert(-1 == port_index(""));
+    assert(-1 == port_index(NULL));
+    assert(!get_port_worker(self, -1));
+    assert(!get_port_worker(self, PORTMAP_LENGTH));
+    port_job_t *job = NULL;
+#ifdef FTY_SENSOR_ENV_BUILD_DRAFT_API
+    self->ports[0].port_file = strdup("/dev/ttyS0");
+    port_worker_t *worker = get_port_worker(self, 0);
+    assert(worker);
+    assert(worker == self->ports[0].worker);
+    assert(worker == get_port_worker(self, 0)); // verify workers are cached
+    sensor = create_sensor("test sensor 1", TEMPERATURE, HUMIDITY, VALID);
+    sensor->port = strdup("1");
+    zhash_update(sensor->gpi, "test gpi 1", "1");
+    job = port_job_new(sensor, worker->port_file);
+    assert(job);
+    assert(job->th);
+    assert(1 == job->gpi_count);
+    assert(1 == job->gpi[0]);
+    assert(GPI_NOT_READ == job->gpi_state[0]);
+    zsock_send(worker->actor, "sp", "ACQUIRE", job); // verify worker fills the job in and hands it back
+    char *cmd = NULL;
+    port_job_t *done = NULL;
+    assert(0 == zsock_recv(worker->actor, "sp", &cmd, &done));
+    assert(streq(cmd, "SAMPLE"));
+    assert(done == job);
+    assert(0 == job->th_result);
+    assert(1 == job->th_sample.T && sim_H == job->th_sample.H);
+    assert(1 == job->gpi_state[0]);
+    zstr_free(&cmd);
+    job->gpi_hold = 10;
+    zsock_send(worker->actor, "sp", "ACQUIRE", job); // verify worker watching GPI still takes jobs
+    assert(0 == zsock_recv(worker->actor, "sp", &cmd, &done));
+    assert(streq(cmd, "SAMPLE") && done == job);
+    zstr_free(&cmd);
+    zclock_sleep(2 * GPI_WATCH_SLICE);
+    int64_t acquire_start = zclock_mono();
+    zsock_send(worker->actor, "sp", "ACQUIRE", job);
+    assert(0 == zsock_recv(worker->actor, "sp", &cmd, &done));
+    assert(streq(cmd, "SAMPLE") && done == job); // verify unchanged GPI lines send no events
+    assert(zclock_mono() - acquire_start < 4 * GPI_WATCH_SLICE);
+    zstr_free(&cmd);
+    free_port_job(job);
+    free_sensor(sensor);
+    zstr_free(&(self->ports[0].port_file));
+    self->ports[0].port_file = strdup("/dev/ttyS1");
+    worker = get_port_worker(self, 0); // verify remapped port gets new worker
+    assert(worker && streq(worker->port_file, "/dev/ttyS1"));
+    free_port_worker(worker); // verify worker can be stopped
+    self->ports[0].worker = NULL;
+    zstr_free(&(self->ports[0].port_file));
+    // stop of server cancels acquisition in progress, it doesn't wait for it.
+    // Target is 100 ms, test bound leaves room for loaded host or valgrind
+    {
+        libth_sim_set_timing(s_testing_sim, 0, 0, 100); // full conversion times, seconds per job
+        unsigned int stuck_conversions = libth_sim_conversions(s_testing_sim);
+        fty_sensor_env_server_t *stopping = fty_sensor_env_server_new();
+        stopping->ports[0].port_file = strdup("sim");
+        external_sensor_t *stuck = create_sensor("stuck", TEMPERATURE, HUMIDITY, VALID);
+        stuck->oversampling = LIBTH_MAX_OVERSAMPLING;
+        port_worker_t *stuck_worker = get_port_worker(stopping, 0);
+        assert(stuck_worker);
+        port_job_t *stuck_job = port_job_new(stuck, "sim");
+        zlist_append(stuck_worker->jobs, stuck_job);
+        zsock_send(stuck_worker->actor, "sp", "ACQUIRE", stuck_job);
+        // worker gets through calibration at default speed into the conversion
+        int64_t deadline = zclock_mono() + 5000;
+        while (stuck_conversions == libth_sim_conversions(s_testing_sim) && zclock_mono() < deadline) {
+            zclock_sleep(10);
+        }
+        assert(stuck_conversions < libth_sim_conversions(s_testing_sim));
+        zclock_sleep(50);
+        int64_t stop_start = zclock_mono();
+        fty_sensor_env_server_destroy(&stopping); // what actor does on $TERM
+        int64_t stop_time = zclock_mono() - stop_start;
+        if (verbose) {
+            log_debug("Server with busy worker stopped in %" PRId64 " ms", stop_time);
+        }
+        if (stop_time >= 100) {
+            log_warning("Server with busy worker stopped in %" PRId64 " ms, over 100 ms target", stop_time);
+        }
+        assert(stop_time < 10 * LIBTH_CANCEL_CHECK);
+        free_sensor(stuck);
+        libth_sim_set_timing(s_testing_sim, 0, 0, 1);
+    }
+#endif // FTY_SENSOR_ENV_BUILD_DRAFT_API
+    // ===== /port workers ========================================================================
+
+    // ===== hotplug ==============================================================================
+    char *hotplug_dir = zsys_sprintf("%s/hotplug", SELFTEST_DIR_RW);
+    mkdir(SELFTEST_DIR_RW, 0755);
+    assert(0 == mkdir(hotplug_dir, 0755) || EEXIST == errno);
+    zactor_t *hotplug = zactor_new(hotplug_actor, hotplug_dir);
+    assert(hotplug);
+    char *hotplug_node = zsys_sprintf("%s/ttyS42", hotplug_dir);
+    char *hotplug_other = zsys_sprintf("%s/console", hotplug_dir);
+    FILE *node = fopen(hotplug_other, "w");
+    assert(node);
+    fclose(node);
+    node = fopen(hotplug_node, "w");
+    assert(node);
+    fclose(node);
+    zmsg_t *hotplug_msg = zmsg_recv(hotplug); // verify only serial port nodes are reported
+    char *hotplug_cmd = zmsg_popstr(hotplug_msg);
+    char *hotplug_name = zmsg_popstr(hotplug_msg);
+    char *hotplug_change = zmsg_popstr(hotplug_msg);
+    assert(streq(hotplug_cmd, "HOTPLUG") && streq(hotplug_name, "ttyS42") && streq(hotplug_change, "ADDED"));
+    zstr_free(&hotplug_change);
+    zmsg_destroy(&hotplug_msg);
+    unlink(hotplug_other);
+    unlink(hotplug_node);
+    do { // unlink may change attributes first
+        zstr_free(&hotplug_cmd);
+        zstr_free(&hotplug_name);
+        zstr_free(&hotplug_change);
+        hotplug_msg = zmsg_recv(hotplug);
+        hotplug_cmd = zmsg_popstr(hotplug_msg);
+        hotplug_name = zmsg_popstr(hotplug_msg);
+        hotplug_change = zmsg_popstr(hotplug_msg);
+        zmsg_destroy(&hotplug_msg);
+        assert(streq(hotplug_name, "ttyS42"));
+    } while (!streq(hotplug_change, "REMOVED")); // verify removed node is reported
+    zstr_free(&hotplug_cmd);
+    zstr_free(&hotplug_name);
+    zstr_free(&hotplug_change);
+    zactor_destroy(&hotplug);
+    zstr_free(&hotplug_other);
+    zstr_free(&hotplug_node);
+    rmdir(hotplug_dir);
+    zstr_free(&hotplug_dir);
+    // ===== /hotplug =============================================================================
+
     // ===== send_message function ================================================================
-    msg = get_measurement(TEMPERATURE, "dummy");
     sensor = create_sensor("test sensor 1", TEMPERATURE, HUMIDITY, VALID);
+    sensor_templates_build(sensor, "/dummy"); // verify incomplete sensor gets no templates
+    assert(NULL == sensor->template_T.subject && 0 == zhash_size(sensor->gpi_template));
     sensor->rack_iname = strdup("dummyrackcontroller-1");
     sensor->port = strdup("1");
-    int rv = send_message(NULL, msg, sensor, HUMIDITY_STR "./dummy", "dummysensor-1", NULL); // verify function fails with wrong arguments
+    zhash_update(sensor->gpi, "dummygpiosensor-1", (char *) "1");
+    sensor_templates_build(sensor, "/dummy");
+    assert(streq(sensor->template_H.type, HUMIDITY_STR "./dummy"));
+    assert(streq(sensor->template_H.subject, HUMIDITY_STR "./dummy@dummyrackcontroller-1"));
+    assert(streq((char *) zhash_lookup(sensor->template_H.aux, "sname"), "test sensor 1"));
+    assert(streq((char *) zhash_lookup(sensor->template_H.aux, "port"), "1"));
+    assert(NULL == zhash_lookup(sensor->template_H.aux, "ext-port"));
+    msg_template_t *gpi_template = (msg_template_t *) zhash_lookup(sensor->gpi_template, "1");
+    assert(gpi_template && streq(gpi_template->subject, STATUSGPI_STR "1./dummy@dummyrackcontroller-1"));
+    assert(streq((char *) zhash_lookup(gpi_template->aux, "sname"), "dummygpiosensor-1"));
+    assert(streq((char *) zhash_lookup(gpi_template->aux, "ext-port"), "1"));
+    int rv = send_message(NULL, &(sensor->template_H), sensor, "0.01", "%", 0, NULL); // verify function fails with wrong arguments
     assert(1 == rv);
-    rv = send_message(self->mlm, NULL, sensor, HUMIDITY_STR "./dummy", "dummysensor-1", NULL); // verify function fails with wrong arguments
+    rv = send_message(self->mlm, NULL, sensor, "0.01", "%", 0, NULL); // verify function fails with wrong arguments
     assert(1 == rv);
-    rv = send_message(self->mlm, msg, NULL, HUMIDITY_STR "./dummy", "dummysensor-1", NULL); // verify function fails with wrong arguments
+    rv = send_message(self->mlm, &(sensor->template_H), NULL, "0.01", "%", 0, NULL); // verify function fails with wrong arguments
     assert(1 == rv);
-    rv = send_message(self->mlm, msg, sensor, NULL, "dummysensor-1", NULL); // verify function fails with wrong arguments
+    rv = send_message(self->mlm, &(sensor->template_H), sensor, NULL, "%", 0, NULL); // verify function fails with wrong arguments
     assert(1 == rv);
-    rv = send_message(self->mlm, msg, sensor, HUMIDITY_STR "./dummy", NULL, NULL); // verify function fails with wrong arguments
-    assert(1 == rv);
-    rv = send_message(self->mlm, msg, sensor, HUMIDITY_STR "./dummy", "dummysensor-1", NULL); // verify function succeeds for regular sensors
+    rv = send_message(self->mlm, &(sensor->template_H), sensor, "0.01", "%", 0, NULL); // verify function succeeds for regular sensors
     assert(0 == rv);
-    msg = get_measurement(TEMPERATURE, "dummy");
-    rv = send_message(self->mlm, msg, sensor, STATUSGPI_STR "1./dummy", "dummygpiosensor-1", "1"); // verify function succeeds for regular sensors
+    const char *extra[] = { "transitions", "2", "changed", "yes", NULL };
+    rv = send_message(self->mlm, gpi_template, sensor, gpi_value(1), "", 0, extra); // verify function succeeds for GPI sensors
     assert(0 == rv);
+    assert(NULL == zhash_lookup(gpi_template->aux, "transitions")); // verify reading aux doesn't stick to template
+    assert(3 == zhash_size(gpi_template->aux));
+    sensor_templates_build(sensor, "/remapped"); // verify templates follow remapped port
+    assert(streq(sensor->template_T.subject, TEMPERATURE_STR "./remapped@dummyrackcontroller-1"));
+    assert(1 == zhash_size(sensor->gpi_template));
     free_sensor(sensor);
     // ===== /send_message function ===============================================================
 
     // ===== handle_proto_sensor function =========================================================
+    port_table_resolve (self); // done by the actor on start
     // add regular sensor
     msg = fty_proto_new (FTY_PROTO_ASSET);
     fty_proto_set_operation(msg, FTY_PROTO_ASSET_OP_CREATE);
@@ -881,6 +2953,13 @@ fty_sensor_env_server_test (bool verbose)
     assert(HUMIDITY == sensor->humidity);
     assert(VALID == sensor->valid);
     assert(streq("1", sensor->port));
+    assert(!sensor->low_resolution);
+    assert(1 == sensor->oversampling && TH_REDUCE_MEDIAN == sensor->reduction);
+    assert(sensor->template_T.subject && streq((char *) zhash_lookup(sensor->template_T.aux, "port"), "1")); // verify templates are built
+    zstr_free(&(self->ports[sensor->port_index].port_file));
+    self->ports[sensor->port_index].port_file = strdup("/old");
+    port_table_resolve (self); // verify templates follow remapped port
+    assert(!strstr(sensor->template_T.subject, "/old") && strstr(sensor->template_T.subject, self->ports[sensor->port_index].port_file));
     // update regular sensor to different parent
     msg = fty_proto_new (FTY_PROTO_ASSET);
     fty_proto_set_operation(msg, FTY_PROTO_ASSET_OP_UPDATE);
@@ -893,6 +2972,14 @@ fty_sensor_env_server_test (bool verbose)
     ext = zhash_new();
     zhash_autofree(ext);
     zhash_insert(ext, FTY_PROTO_ASSET_EXT_PORT, "1");
+    zhash_insert(ext, RESOLUTION_STR, RESOLUTION_LOW);
+    zhash_insert(ext, OVERSAMPLING_STR, "100");
+    zhash_insert(ext, REDUCTION_STR, REDUCTION_MEAN);
+    zhash_insert(ext, TH_INTERVAL_STR, "600000");
+    zhash_insert(ext, GPI_INTERVAL_STR, "50");
+    zhash_insert(ext, TEMPERATURE_DEADBAND_STR, "0.2");
+    zhash_insert(ext, HUMIDITY_DEADBAND_STR, "1%");
+    zhash_insert(ext, GPI_PUBLISH_STR, GPI_PUBLISH_CHANGE);
     fty_proto_set_ext(msg, &ext);
     fty_proto_set_name(msg, "dummysensor-1");
     message = fty_proto_encode (&msg);
@@ -907,6 +2994,16 @@ fty_sensor_env_server_test (bool verbose)
     assert(HUMIDITY == sensor->humidity);
     assert(VALID == sensor->valid);
     assert(streq("1", sensor->port));
+    assert(sensor->low_resolution); // verify resolution is taken from ext attributes
+    assert(LIBTH_MAX_OVERSAMPLING == sensor->oversampling); // verify oversampling is limited
+    assert(TH_REDUCE_TRIMMED_MEAN == sensor->reduction);
+    assert(600000 == sensor_interval(self, sensor, METRIC_TH)); // verify intervals are taken from ext attributes
+    assert(POLLING_INTERVAL_MIN == sensor_interval(self, sensor, METRIC_GPI)); // verify they are limited
+    assert(TIME_TO_LIVE == sensor_ttl(self, sensor, METRIC_GPI));
+    assert(600 * TTL_INTERVALS == sensor_ttl(self, sensor, METRIC_TH)); // verify metric outlives its interval
+    assert(sensor->deadband_T.enabled && 20 == sensor->deadband_T.absolute); // verify deadbands are taken from ext attributes
+    assert(sensor->deadband_H.enabled && 100 == sensor->deadband_H.relative && 0 == sensor->deadband_H.absolute);
+    assert(sensor->gpi_change_only); // verify GPI publishing has its own switch
     // add another sensor
     msg = fty_proto_new (FTY_PROTO_ASSET);
     fty_proto_set_operation(msg, FTY_PROTO_ASSET_OP_CREATE);
@@ -922,8 +3019,10 @@ fty_sensor_env_server_test (bool verbose)
     fty_proto_set_ext(msg, &ext);
     fty_proto_set_name(msg, "dummysensor-2");
     message = fty_proto_encode (&msg);
+    const char *subject_before = search_sensor(self->sensors, "dummysensor-1")->template_T.subject;
     rv = handle_proto_sensor(self, message); // verify sensor is added properly
     assert(0 == rv);
+    assert(subject_before == search_sensor(self->sensors, "dummysensor-1")->template_T.subject); // verify only changed sensor is rebuilt
     sensor = search_sensor(self->sensors, "dummysensor-2");
     assert(sensor);
     assert(0 == strcmp(sensor->iname, "dummysensor-2"));
@@ -978,6 +3077,7 @@ fty_sensor_env_server_test (bool verbose)
     }
     assert(sensor_gpi_port);
     assert(streq("dummysensorgpi-1", zhash_cursor(sensor->gpi)));
+    assert(zhash_lookup(sensor->gpi_template, "1")); // verify GPI gets template of sensor it is attached to
     // add another GPI sensor to existing sensor
     msg = fty_proto_new (FTY_PROTO_ASSET);
     fty_proto_set_operation(msg, FTY_PROTO_ASSET_OP_CREATE);
@@ -991,6 +3091,7 @@ fty_sensor_env_server_test (bool verbose)
     ext = zhash_new();
     zhash_autofree(ext);
     zhash_insert(ext, FTY_PROTO_ASSET_EXT_PORT, "2");
+    zhash_insert(ext, GPI_MODE_STR, GPI_MODE_COUNTER);
     fty_proto_set_ext(msg, &ext);
     fty_proto_set_name(msg, "dummysensorgpi-2");
     message = fty_proto_encode (&msg);
@@ -1007,6 +3108,15 @@ fty_sensor_env_server_test (bool verbose)
     }
     assert(sensor_gpi_port);
     assert(streq("dummysensorgpi-2", zhash_cursor(sensor->gpi)));
+    assert(zhash_lookup(sensor->gpi_counter, "dummysensorgpi-2")); // verify counter mode is taken from ext attributes
+    assert(!zhash_lookup(sensor->gpi_counter, "dummysensorgpi-1"));
+    job = port_job_new(sensor, "dummy");
+    assert(job->gpi_counter && job->gpi_transitions);
+    for (size_t i = 0; i < job->gpi_count; i++) {
+        assert(job->gpi_counter[i] == (2 == job->gpi[i]));
+        assert(-1 == job->gpi_transitions[i]);
+    }
+    free_port_job(job);
     // delete sensor GPI
     msg = fty_proto_new (FTY_PROTO_ASSET);
     fty_proto_set_operation(msg, FTY_PROTO_ASSET_OP_DELETE);
@@ -1035,6 +3145,7 @@ fty_sensor_env_server_test (bool verbose)
         sensor_gpi_port = (char *) zhash_next(sensor->gpi);
     }
     assert(NULL == sensor_gpi_port);
+    assert(0 == zhash_size(sensor->gpi_counter));
     // add GPI sensor to non-existing sensor
     msg = fty_proto_new (FTY_PROTO_ASSET);
     fty_proto_set_operation(msg, FTY_PROTO_ASSET_OP_CREATE);
@@ -1309,13 +3420,157 @@ fty_sensor_env_server_test (bool verbose)
     assert(-1 == rv);
     // ===== /handle_proto_sensor function ========================================================
 
+    // ===== poll schedule ========================================================================
+    {
+        poll_schedule_t schedule;
+        poll_schedule_init (&schedule, 5000, 1000);
+        assert (5000 == poll_schedule_wait (&schedule, 1000));
+        assert (1000 == poll_schedule_wait (&schedule, 5000)); // verify waits are counted from the deadline
+        assert (0 == poll_schedule_wait (&schedule, 6000));
+        assert (0 == poll_schedule_next (&schedule, 9500)); // verify cycle duration doesn't shift the cadence
+        assert (11000 == schedule.deadline);
+        assert (0 == poll_schedule_next (&schedule, 11000 + 4999));
+        assert (16000 == schedule.deadline);
+        assert (2 == poll_schedule_next (&schedule, 16000 + 5000 + 5000)); // verify overrunning cycle skips deadlines
+        assert (31000 == schedule.deadline);
+        assert (3 == schedule.cycles && 2 == schedule.missed);
+
+        fty_sensor_env_server_t *queued = fty_sensor_env_server_new ();
+        assert (POLLING_INTERVAL == poll_queue_wait (queued, 0));
+        int64_t deadlines [] = { 700, 300, 900, 100, 500, 300, 800, 200, 600, 400 };
+        for (size_t i = 0; i < sizeof (deadlines) / sizeof (deadlines [0]); ++i) {
+            assert (0 == poll_queue_push (queued, deadlines [i], "sensor", (metric_class_t) (i % METRIC_CLASSES)));
+        }
+        assert (50 == poll_queue_wait (queued, 50));
+        assert (0 == poll_queue_wait (queued, 100));
+        poll_entry_t entry;
+        int64_t previous = 0;
+        for (size_t i = 0; i < sizeof (deadlines) / sizeof (deadlines [0]); ++i) {
+            assert (0 == poll_queue_pop (queued, &entry)); // verify deadlines come in order
+            assert (entry.deadline >= previous && streq (entry.iname, "sensor"));
+            previous = entry.deadline;
+            free (entry.iname);
+        }
+        assert (900 == previous);
+        assert (-1 == poll_queue_pop (queued, &entry));
+        assert (0 == poll_queue_push (queued, 100, "left", METRIC_GPI)); // verify queue is freed with entries
+        fty_sensor_env_server_destroy (&queued);
+
+        fty_sensor_env_server_t *adapting = fty_sensor_env_server_new ();
+        external_sensor_t *adapted = create_sensor ("adapted", TEMPERATURE, HUMIDITY, VALID);
+        adapted->base_interval[METRIC_TH] = 5000;
+        poll_schedule_init (&(adapted->schedule[METRIC_TH]), 5000, 0);
+        th_sample_t reading = { 0, 0, 2500, 5000, 1, 0, 0 };
+        adapt_th_interval (adapting, adapted, &reading, 5000);
+        assert (5000 == adapted->schedule[METRIC_TH].interval); // verify adaptive polling is off by default
+        adapting->adaptive_ceiling = 30000;
+        int64_t when = 5000;
+        int64_t intervals [] = { 5000, 10000, 20000, 30000, 30000 };
+        for (size_t i = 0; i < sizeof (intervals) / sizeof (intervals [0]); ++i) {
+            when += adapted->schedule[METRIC_TH].interval;
+            reading.T += 2; // verify stable readings stretch the interval up to the ceiling
+            adapt_th_interval (adapting, adapted, &reading, when);
+            assert (intervals [i] == adapted->schedule[METRIC_TH].interval);
+        }
+        assert (0 == adapting->queue_size);
+        when += 30000;
+        reading.T += 20; // verify slow change out of noise band keeps the interval
+        adapt_th_interval (adapting, adapted, &reading, when);
+        assert (30000 == adapted->schedule[METRIC_TH].interval);
+        adapted->schedule[METRIC_TH].deadline = when + 30000;
+        when += 1000;
+        reading.H += 100; // verify fast change drops to floor and pulls next poll in
+        adapt_th_interval (adapting, adapted, &reading, when);
+        assert (5000 == adapted->schedule[METRIC_TH].interval);
+        assert (when + 5000 == adapted->schedule[METRIC_TH].deadline);
+        assert (1 == adapting->queue_size && when + 5000 == adapting->queue[0].deadline);
+        assert (7 == adapted->adaptive.polls);
+        assert (TIME_TO_LIVE == sensor_ttl (adapting, adapted, METRIC_TH));
+        adapting->adaptive_ceiling = 600000;
+        assert (1800 == sensor_ttl (adapting, adapted, METRIC_TH)); // verify metric outlives adaptive interval
+        report_adaptive (adapting); // just verify there will be no crash
+
+        deadband_t band;
+        deadband_parse (NULL, &band);
+        assert (!band.enabled); // verify every reading is published by default
+        deadband_parse ("garbage", &band);
+        assert (!band.enabled);
+        deadband_parse ("0.5%x", &band);
+        assert (!band.enabled);
+        deadband_parse ("0", &band);
+        assert (band.enabled && 0 == band.absolute && 0 == band.relative);
+        deadband_parse ("2%", &band);
+        assert (band.enabled && 0 == band.absolute && 200 == band.relative);
+        deadband_parse ("0.25", &band);
+        assert (band.enabled && 25 == band.absolute && 0 == band.relative);
+        published_t published = { false, 0, 0 };
+        assert (deadband_pass (&published, &band, 2000, 0, 300)); // verify first value is published
+        assert (!deadband_pass (&published, &band, 2025, 1000, 300)); // verify values within band are not
+        assert (!deadband_pass (&published, &band, 1975, 2000, 300));
+        assert (deadband_pass (&published, &band, 2026, 3000, 300)); // verify value leaving band is
+        assert (2026 == published.value && 3000 == published.when);
+        assert (!deadband_pass (&published, &band, 2026, 3000 + 99999, 300));
+        assert (deadband_pass (&published, &band, 2026, 3000 + 100000, 300)); // verify heartbeat at third of TTL
+        deadband_parse ("2%", &band);
+        assert (!deadband_pass (&published, &band, 2066, 103001, 300)); // verify relative band
+        assert (deadband_pass (&published, &band, 2067, 103002, 300));
+        band.enabled = false;
+        assert (deadband_pass (&published, &band, 2067, 103003, 300));
+        assert (gpi_deadband_pass (adapting, adapted, "1", 0, false, 0)); // verify GPI states are published without deadband
+        assert (gpi_deadband_pass (adapting, adapted, "1", 0, false, 0));
+        deadband_parse ("0.1", &(adapted->deadband_T));
+        assert (gpi_deadband_pass (adapting, adapted, "1", 0, false, 0)); // verify T&H deadband leaves GPI alone
+        assert (gpi_deadband_pass (adapting, adapted, "1", 0, false, 0));
+        adapted->gpi_change_only = true;
+        assert (gpi_deadband_pass (adapting, adapted, "1", 0, false, 0));
+        assert (!gpi_deadband_pass (adapting, adapted, "1", 0, false, 1)); // verify unchanged GPI states wait for heartbeat
+        assert (gpi_deadband_pass (adapting, adapted, "2", 0, false, 1));
+        assert (gpi_deadband_pass (adapting, adapted, "1", 1, false, 2)); // verify GPI changes are published at once
+        assert (gpi_deadband_pass (adapting, adapted, "1", 1, true, 3)); // verify counted transitions too
+        assert (!gpi_deadband_pass (adapting, adapted, "1", 1, false, 4));
+        zhash_update (adapted->gpi, "adapted gpi 3", (char *) "3");
+        zlist_append (adapting->sensors, adapted);
+        port_job_t *detached = port_job_new (adapted, "dummy");
+        publish_job (adapting, detached); // verify GPI not read leaves deadband state alone
+        assert (NULL == zhash_lookup (adapted->gpi_published, "3"));
+        free_port_job (detached);
+        zlist_remove (adapting->sensors, adapted);
+        free_sensor (adapted);
+        fty_sensor_env_server_destroy (&adapting);
+    }
+    // ===== /poll schedule =======================================================================
+
     // ===== read_sensors function ================================================================
+#ifdef FTY_SENSOR_ENV_BUILD_DRAFT_API
+    assert(-1 == search_sensor(self->sensors, "dummysensor-1")->port_index);
+    assert(2 == search_sensor(self->sensors, "dummysensor-3")->port_index);
     read_sensors (self); // just verify there will be no crash
+    for (int i = 0; i < PORTMAP_LENGTH; ++i) {
+        assert((2 == i) == (NULL != self->ports[i].worker)); // verify there is one worker for each used port
+    }
+    assert(1 == zlist_size(self->ports[2].worker->jobs)); // verify jobs are handed out without waiting for them
+    assert(collect_job(self, &(self->ports[2])));
+    assert(0 == zlist_size(self->ports[2].worker->jobs));
+    assert(0 < poll_queue_wait(self, zclock_mono())); // verify polled sensors wait for their next deadlines
+    sensor = search_sensor(self->sensors, "dummysensor-3");
+    assert(0 == sensor->due && 1 == sensor->schedule[METRIC_TH].cycles);
+    int64_t th_deadline = sensor->schedule[METRIC_TH].deadline;
+    read_sensors (self);
+    assert(th_deadline == sensor->schedule[METRIC_TH].deadline); // verify sensors not due are left alone
+    assert(self->ports[2].worker); // verify their workers are kept
+    sensor = search_sensor(self->sensors, "dummysensor-3");
+    zlist_remove(self->sensors, sensor);
+    read_sensors (self);
+    assert(!self->ports[2].worker); // verify workers of unused ports are stopped
+#endif // FTY_SENSOR_ENV_BUILD_DRAFT_API
     // ===== /read_sensors function ===============================================================
     // close tests
     fty_sensor_env_server_destroy (&self);
+#ifdef FTY_SENSOR_ENV_BUILD_DRAFT_API
+    s_testing_session = NULL;
+    libth_sim_destroy(&s_testing_sim);
+#endif // FTY_SENSOR_ENV_BUILD_DRAFT_API
     //  @end
 
-    testing = 0;
     printf ("OK\n");
 }
@@ -42,72 +42,173 @@
 #include <termios.h>
 #include <linux/serial.h>
 #include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
 
 #include "fty_sensor_env_classes.h"
 
 //  --------------------------------------------------------------------------
 
-void compensate_humidity(int H, int T, int32_t* out) {
-    double tmp = H;
-    // Get linear relative humidity
-    tmp = -2.0468 + 0.0367 * tmp - 1.5955E-6 * tmp * tmp;
-    // Temperature compensation
-    tmp = ((double)T/100 - 25.0)*(0.01 + 0.00008 * (double)H) + tmp;
-    *out = tmp * 100;
+/*
+ Compensation is done in fixed point. Datasheet coefficients are exact
+ decimals, scaled by HUMIDITY_SCALE they are integers and the whole
+ formula is computed exactly in 64 bits, then truncated to hundredths
+ of % the way the conversion from double did.
+*/
+
+#define HUMIDITY_SCALE  1000000000000LL     // 1e12, scale of coefficients
+#define HUMIDITY_C1     -2046800000000LL    // -2.0468
+#define HUMIDITY_C2     36700000000LL       // 0.0367, 12bit
+#define HUMIDITY_C3     -1595500LL          // -1.5955E-6, 12bit
+#define HUMIDITY_T2     800000LL            // 0.00008 / 100, 12bit
+#define HUMIDITY_C2_LOW 587200000000LL      // 0.5872, 8bit
+#define HUMIDITY_C3_LOW -408450000LL        // -4.0845E-4, 8bit
+#define HUMIDITY_T2_LOW 12800000LL          // 0.00128 / 100, 8bit
+#define HUMIDITY_T1     100000000LL         // 0.01 / 100
+
+static inline int32_t s_compensate_humidity(int64_t H, int64_t T,
+        int64_t c2, int64_t c3, int64_t t2) {
+    // T is in hundredths of C, so are temperature coefficients
+    int64_t x = HUMIDITY_C1 + c2 * H + c3 * H * H + (T - 2500) * (HUMIDITY_T1 + t2 * H);
+    return (int32_t)(x / (HUMIDITY_SCALE / 100));
+}
+
+void compensate_humidity(int H, int T, bool low_res, int32_t* out) {
+    if(low_res)
+        *out = s_compensate_humidity(H, T, HUMIDITY_C2_LOW, HUMIDITY_C3_LOW, HUMIDITY_T2_LOW);
+    else
+        *out = s_compensate_humidity(H, T, HUMIDITY_C2, HUMIDITY_C3, HUMIDITY_T2);
     return;
 }
 
-void compensate_temp(int in, int32_t *out) {
-    // Initial compensation for 5V taken from datasheet
-    *out = in - 4010;
+void compensate_temp(int in, bool low_res, int32_t *out) {
+    // Initial compensation for 5V taken from datasheet, 12bit reading
+    // counts by 0.04 C, 14bit one by 0.01 C
+    if(low_res)
+        *out = in * 4 - 4010;
+    else
+        *out = in - 4010;
     return;
 }
 
+void compensate_th_batch(const int *restrict raw_T, const int *restrict raw_H,
+        size_t count, bool low_res, int32_t *restrict T, int32_t *restrict H) {
+    // Coefficients are chosen once, loop has no branches to vectorize
+    int32_t t_mul = low_res ? 4 : 1;
+    int64_t c2 = low_res ? HUMIDITY_C2_LOW : HUMIDITY_C2;
+    int64_t c3 = low_res ? HUMIDITY_C3_LOW : HUMIDITY_C3;
+    int64_t t2 = low_res ? HUMIDITY_T2_LOW : HUMIDITY_T2;
+    for(size_t i = 0; i < count; i++) {
+        int32_t t = raw_T[i] * t_mul - 4010;
+        T[i] = t;
+        H[i] = s_compensate_humidity(raw_H[i], t, c2, c3, t2);
+    }
+}
+
 void msleep(unsigned int m) {
     usleep(m*1000);
 }
 
-void set_tx(int fd, int state) {
-    if(fd < 0)
-        return;
-    int what = TIOCM_DTR;
-    if(state) {
-        ioctl(fd, TIOCMBIS, &what);
-    } else {
-        ioctl(fd, TIOCMBIC, &what);
+//  Remember when a line changed, next change is timed from here
+static void s_mark_edge(libth_port_t *port) {
+    clock_gettime(CLOCK_MONOTONIC, &port->edge);
+}
+
+//  Set both DATA and SCK lines by one ioctl, other modem lines are kept
+static void s_set_lines(libth_port_t *port, int tx, int sck) {
+    int lines = port->lines & ~(TIOCM_DTR | TIOCM_RTS);
+    if(tx)
+        lines |= TIOCM_DTR;
+    if(sck)
+        lines |= TIOCM_RTS;
+    if(lines != port->lines) {
+        port->transport->set_lines(port, lines);
+        port->lines = lines;
     }
+    port->clock = sck ? 1 : 0;
+    s_mark_edge(port);
+}
+
+void set_tx(libth_port_t *port, int state) {
+    if(!port || port->fd < 0)
+        return;
+    s_set_lines(port, state, port->clock);
 }
 
-int get_rx(int fd) {
+int get_rx(libth_port_t *port) {
     int what = 0;
-    if(fd < 0)
+    if(!port || port->fd < 0)
         return -1;
 
-    ioctl(fd, TIOCMGET, &what);
+    port->transport->get_lines(port, &what);
     return !(what & TIOCM_CTS);
 }
 
-void tick(int fd, int state) {
-    if(fd < 0)
+void tick(libth_port_t *port, int state) {
+    if(!port || port->fd < 0)
         return;
-    static int last = 1;
     if(state == -1) {
-        state = (last + 1) % 2;
+        state = (port->clock + 1) % 2;
     }
-    int what = TIOCM_RTS;
-    if(state) {
-        ioctl(fd, TIOCMBIS, &what);
-    } else {
-        ioctl(fd, TIOCMBIC, &what);
+    s_set_lines(port, port->lines & TIOCM_DTR, state);
+}
+
+//  Sleep until half period after the last line change. Absolute deadline
+//  counts time spent in ioctl and doesn't oversleep like relative usleep
+void half_period(libth_port_t *port) {
+    struct timespec deadline = port->edge;
+    deadline.tv_nsec += port->half_period * 1000L;
+    while(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_nsec -= 1000000000L;
+        deadline.tv_sec++;
     }
-    last = state;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+        ;
 }
 
-void long_tick(int fd, int state) {
-    tick(fd, state);
-    msleep(1);
+void long_tick(libth_port_t *port, int state) {
+    tick(port, state);
+    half_period(port);
+}
+
+/*
+ Commands are compiled once into waveforms, list of edges setting DATA
+ and SCK together. New DATA bit rides on falling edge of SCK, sensor
+ samples it on the rising one.
+*/
+
+#define WAVE_TX     0x01    // DATA line high
+#define WAVE_SCK    0x02    // SCK line high
+#define WAVE_WAIT   0x04    // hold lines for half period after the edge
+#define WAVE_ACK    0x08    // sample ACK after the hold
+
+#define WAVE_MAX_EDGES  32
+
+typedef struct _wave_t {
+    size_t  length;
+    unsigned char edges[WAVE_MAX_EDGES];
+} wave_t;
+
+static void s_wave_edge(wave_t *wave, int tx, int sck, unsigned char flags) {
+    assert(wave->length < WAVE_MAX_EDGES);
+    wave->edges[wave->length++] = (tx ? WAVE_TX : 0) | (sck ? WAVE_SCK : 0) | flags;
 }
 
+//  Change DATA together with the last edge, which must be falling SCK
+static void s_wave_data(wave_t *wave, int tx) {
+    assert(wave->length > 0 && !(wave->edges[wave->length - 1] & WAVE_SCK));
+    if(tx)
+        wave->edges[wave->length - 1] |= WAVE_TX;
+    else
+        wave->edges[wave->length - 1] &= ~WAVE_TX;
+}
 
 /*
  Start sending commands
@@ -117,25 +218,16 @@ void long_tick(int fd, int state) {
  SCK : ___|   |___|   |______
 */
 
-void command_start(int fd) {
-    // Init
-    set_tx(fd, 1);
-    tick(fd, 0);
-    // Wait a little with clocks
-    long_tick(fd, 0);
-    long_tick(fd, 1);
-    // Zero for two ticks
-    set_tx(fd, 0);
-    msleep(1);
-    long_tick(fd, 0);
-    long_tick(fd, 1);
-    // Back to one
-    set_tx(fd, 1);
-    msleep(1);
-    tick(fd, 0);
+static void s_wave_start(wave_t *wave) {
+    s_wave_edge(wave, 1, 0, WAVE_WAIT);
+    s_wave_edge(wave, 1, 1, WAVE_WAIT);
+    s_wave_edge(wave, 0, 1, WAVE_WAIT);
+    s_wave_edge(wave, 0, 0, WAVE_WAIT);
+    s_wave_edge(wave, 0, 1, WAVE_WAIT);
+    s_wave_edge(wave, 1, 1, WAVE_WAIT);
+    s_wave_edge(wave, 1, 0, WAVE_WAIT);
 }
 
-
 /*
  Reset                                                 (-- start sending --)
        _____________________________________________________         ________
@@ -145,153 +237,1103 @@ void command_start(int fd) {
 
 */
 
-void reset_device(int fd) {
-    if(fd < 0)
-        return;
-
-    // Init
-    set_tx(fd, 1);
-    tick(fd, 0);
-    // Long 1
+static void s_wave_reset(wave_t *wave) {
+    s_wave_edge(wave, 1, 0, WAVE_WAIT);
     for(int i = 0; i < 9; i++) {
-        long_tick(fd, 1);
-        long_tick(fd, 0);
+        s_wave_edge(wave, 1, 1, WAVE_WAIT);
+        s_wave_edge(wave, 1, 0, WAVE_WAIT);
+    }
+    s_wave_start(wave);
+}
+
+//  Byte MSB first, then release DATA for ACK of the sensor
+static void s_wave_byte(wave_t *wave, unsigned char val) {
+    for(unsigned char mask = 0x80; mask > 0; mask = mask >> 1) {
+        int tx = (val & mask) ? 1 : 0;
+        s_wave_data(wave, tx);
+        s_wave_edge(wave, tx, 1, WAVE_WAIT);
+        s_wave_edge(wave, tx, 0, WAVE_WAIT);
+    }
+    s_wave_data(wave, 1);
+    s_wave_edge(wave, 1, 1, WAVE_WAIT | WAVE_ACK);
+    s_wave_edge(wave, 1, 0, WAVE_WAIT);
+}
+
+//  Drive the waveform, returns 0 if sensor acknowledged, 1 otherwise and
+//  -1 if the port got cancelled in the middle of it
+static int s_wave_run(libth_port_t *port, const wave_t *wave) {
+    int err = 0;
+    for(size_t i = 0; i < wave->length; i++) {
+        unsigned char edge = wave->edges[i];
+        if(libth_port_cancelled(port))
+            return -1;
+        s_set_lines(port, edge & WAVE_TX, edge & WAVE_SCK);
+        if(edge & WAVE_WAIT)
+            half_period(port);
+        if((edge & WAVE_ACK) && get_rx(port))
+            err = 1;
     }
-    command_start(fd);
+    return err;
 }
 
-int read_byte(int fd, unsigned char *val, int ack) {
-    set_tx(fd, 1);
+typedef struct _command_wave_t {
+    unsigned char command;
+    wave_t wave;
+} command_wave_t;
+
+static command_wave_t s_command_waves[] = {
+    { MEASURE_TEMP, { 0, { 0 } } },
+    { MEASURE_HUMI, { 0, { 0 } } },
+    { STATUS_REG_R, { 0, { 0 } } },
+    { STATUS_REG_W, { 0, { 0 } } },
+    { RESET,        { 0, { 0 } } }
+};
+#define COMMAND_WAVES (sizeof(s_command_waves) / sizeof(s_command_waves[0]))
+static wave_t s_reset_wave;
+static pthread_once_t s_waves_once = PTHREAD_ONCE_INIT;
+
+static void s_waves_init(void) {
+    for(size_t i = 0; i < COMMAND_WAVES; i++) {
+        s_wave_start(&s_command_waves[i].wave);
+        s_wave_byte(&s_command_waves[i].wave, s_command_waves[i].command);
+    }
+    s_wave_reset(&s_reset_wave);
+}
+
+//  Start transmission and send command, returns 0 if sensor acknowledged it
+int send_command(libth_port_t *port, unsigned char command) {
+    if(!port || port->fd < 0)
+        return -1;
+    pthread_once(&s_waves_once, s_waves_init);
+    for(size_t i = 0; i < COMMAND_WAVES; i++) {
+        if(s_command_waves[i].command == command)
+            return s_wave_run(port, &s_command_waves[i].wave);
+    }
+    wave_t wave = { 0, { 0 } };
+    s_wave_start(&wave);
+    s_wave_byte(&wave, command);
+    return s_wave_run(port, &wave);
+}
+
+void reset_device(libth_port_t *port) {
+    if(!port || port->fd < 0)
+        return;
+    pthread_once(&s_waves_once, s_waves_init);
+    s_wave_run(port, &s_reset_wave);
+}
+
+int read_byte(libth_port_t *port, unsigned char *val, int ack) {
+    set_tx(port, 1);
     *val = 0;
     for(unsigned char mask = 0x80; mask > 0; mask = mask >> 1) {
-        long_tick(fd, 1);
-        if(get_rx(fd))
+        // at slow SCK byte takes tens of ms, stop is not held up by it
+        if(libth_port_cancelled(port))
+            return -1;
+        long_tick(port, 1);
+        if(get_rx(port))
             *val = (*val) | mask;
-        long_tick(fd, 0);
+        long_tick(port, 0);
     }
     if(ack)
-        set_tx(fd, 0);
+        set_tx(port, 0);
     else
-        set_tx(fd, 1);
-    long_tick(fd, 1);
-    long_tick(fd, 0);
-    set_tx(fd, 1);
+        set_tx(port, 1);
+    long_tick(port, 1);
+    long_tick(port, 0);
+    set_tx(port, 1);
     return 0;
 }
 
-int write_byte(int fd, unsigned char val) {
-    int err = 0;
-    for(unsigned char mask = 0x80; mask > 0; mask = mask >> 1) {
-        set_tx(fd, val & mask);
-        long_tick(fd, 1);
-        long_tick(fd, 0);
-    }
-    set_tx(fd, 1);
-    long_tick(fd, 1);
-    if(get_rx(fd))
-        err = 1;
-    long_tick(fd, 0);
-    return err;
+int write_byte(libth_port_t *port, unsigned char val) {
+    // continues after falling SCK, first bit rides on a fresh edge
+    wave_t wave = { 0, { 0 } };
+    s_wave_edge(&wave, port->lines & TIOCM_DTR, 0, 0);
+    s_wave_byte(&wave, val);
+    return s_wave_run(port, &wave);
 }
 
-int read_gpi(int fd, int port) {
+int read_gpi_lines(libth_port_t *port) {
     int ret = 0;
-    if(fd < 0)
+    if(!port || port->fd < 0)
         return -1;
 
-    set_tx(fd, 1);
+    set_tx(port, 1);
     msleep(1);
-    if (-1 == ioctl(fd, TIOCMGET, &ret))
-        return -1;
-    if (1 == port) {
-        ret &= GPI_PORT1_MASK;
-        ret >>= GPI_PORT1_BITSHIFT;
-    } else if (2 == port) {
-        ret &= GPI_PORT2_MASK;
-        ret >>= GPI_PORT2_BITSHIFT;
-    } else {
-        ret = -1;
+    if (-1 == port->transport->get_lines(port, &ret))
+        return -1;
+    return ret & GPI_LINES_MASK;
+}
+
+int gpi_from_lines(int lines, int gpi) {
+    if (1 == gpi)
+        return (lines & GPI_PORT1_MASK) >> GPI_PORT1_BITSHIFT;
+    if (2 == gpi)
+        return (lines & GPI_PORT2_MASK) >> GPI_PORT2_BITSHIFT;
+    return -1;
+}
+
+int read_gpi(libth_port_t *port, int gpi) {
+    int lines = read_gpi_lines(port);
+    if (lines < 0)
+        return -1;
+    return gpi_from_lines(lines, gpi);
+}
+
+int read_gpi_counters(libth_port_t *port, unsigned int *transitions) {
+    if(!port || port->fd < 0 || !transitions)
+        return -1;
+    if(!port->transport->get_counters) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return port->transport->get_counters(port, transitions);
+}
+
+void libth_port_set_cancel(libth_port_t *port, const int *token) {
+    if(port)
+        port->cancel = token;
+}
+
+void libth_cancel(int *token) {
+    if(token)
+        __atomic_store_n(token, 1, __ATOMIC_RELEASE);
+}
+
+void libth_cancel_clear(int *token) {
+    if(token)
+        __atomic_store_n(token, 0, __ATOMIC_RELEASE);
+}
+
+bool libth_port_cancelled(const libth_port_t *port) {
+    return port && port->cancel && __atomic_load_n(port->cancel, __ATOMIC_ACQUIRE);
+}
+
+//  Fail with ECANCELED if the port was cancelled
+static int s_check_cancel(libth_port_t *port) {
+    if(!libth_port_cancelled(port))
+        return 0;
+    errno = ECANCELED;
+    return -1;
+}
+
+//  Waits are split into slices, cancellation is checked between them
+static unsigned int s_cancel_slice(int64_t wait) {
+    return wait > LIBTH_CANCEL_CHECK ? LIBTH_CANCEL_CHECK : (unsigned int) wait;
+}
+
+//  Transport can't wait for modem lines, waits poll them instead. Said once,
+//  it is the same for all waits from then on
+static void s_polling_notice(libth_port_t *port) {
+    static bool noticed = false;
+    if(!__atomic_exchange_n(&noticed, true, __ATOMIC_RELAXED))
+        log_warning("Unable to wait for lines of %s (%s), polling them",
+                port->path ? port->path : "port", strerror(errno));
+}
+
+int wait_gpi(libth_port_t *port, unsigned int timeout) {
+    if(!port || port->fd < 0)
+        return -1;
+    int64_t deadline = zclock_mono() + timeout;
+    int64_t now;
+    while(s_check_cancel(port) == 0) {
+        now = zclock_mono();
+        if(port->transport->wait_lines(port, GPI_LINES_MASK, s_cancel_slice(deadline - now)) == 0)
+            return 0;
+        if(errno != EINTR && errno != ETIMEDOUT) {
+            // Transport can't wait for modem lines, caller compares snapshots
+            s_polling_notice(port);
+            msleep(timeout < LIBTH_GPI_POLL ? timeout : LIBTH_GPI_POLL);
+            return 0;
+        }
+        if(zclock_mono() >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    return -1;
+}
+
+//  Wait for sensor to pull DATA low once conversion is finished, returns 0
+//  when it happened within timeout (ms), -1 otherwise
+int wait_conversion(libth_port_t *port, unsigned int timeout) {
+    int64_t deadline = zclock_mono() + timeout;
+
+    while(get_rx(port)) {
+        int64_t now = zclock_mono();
+        if(now >= deadline || s_check_cancel(port))
+            return -1;
+        if(port->transport->wait_lines(port, TIOCM_CTS, s_cancel_slice(deadline - now)) < 0 &&
+                errno != EINTR && errno != ETIMEDOUT) {
+            // Transport can't wait for modem lines, poll them. Conversion
+            // takes tens of ms at least, there is no point polling faster
+            s_polling_notice(port);
+            while(get_rx(port) && zclock_mono() < deadline && !libth_port_cancelled(port))
+                msleep(LIBTH_CONVERSION_POLL);
+            if(s_check_cancel(port))
+                return -1;
+            break;
+        }
+    }
+    return get_rx(port) ? -1 : 0;
+}
+
+//  CRC-8 of SHT1x, polynomial x^8 + x^5 + x^4 + 1, MSB first. Table is
+//  expanded by preprocessor, one shift of the register per CRC_SHIFT
+#define CRC_SHIFT(c)    ((((c) << 1) & 0xff) ^ ((((c) >> 7) & 1) * 0x31))
+#define CRC_BYTE(c)     CRC_SHIFT(CRC_SHIFT(CRC_SHIFT(CRC_SHIFT( \
+                        CRC_SHIFT(CRC_SHIFT(CRC_SHIFT(CRC_SHIFT(c))))))))
+#define CRC_4(i)        CRC_BYTE(i), CRC_BYTE(i + 1), CRC_BYTE(i + 2), CRC_BYTE(i + 3)
+#define CRC_16(i)       CRC_4(i), CRC_4(i + 4), CRC_4(i + 8), CRC_4(i + 12)
+#define CRC_64(i)       CRC_16(i), CRC_16(i + 16), CRC_16(i + 32), CRC_16(i + 48)
+
+static const unsigned char s_crc_table[256] = {
+    CRC_64(0), CRC_64(64), CRC_64(128), CRC_64(192)
+};
+
+static unsigned char s_crc8(unsigned char crc, unsigned char byte) {
+    return s_crc_table[crc ^ byte];
+}
+
+static unsigned char s_reverse(unsigned char byte) {
+    unsigned char out = 0;
+    for(int i = 0; i < 8; i++) {
+        out = (out << 1) | (byte & 1);
+        byte = byte >> 1;
+    }
+    return out;
+}
+
+//  CRC starts from reversed low nibble of status register and sensor
+//  sends the result bit reversed
+static unsigned char s_crc_init(unsigned char status) {
+    return s_reverse(status & 0x0f);
+}
+
+int read_status(libth_port_t *port, unsigned char *status) {
+    unsigned char crc;
+    if(!port || port->fd < 0 || !status)
+        return -1;
+
+    if(send_command(port, STATUS_REG_R))
+        return -1;
+    read_byte(port, status, 1);
+    read_byte(port, &crc, 0);
+
+    // sensor could have been power cycled meanwhile, take the nibble
+    // from the register just read
+    unsigned char expected = s_crc8(s_crc_init(*status), STATUS_REG_R);
+    expected = s_crc8(expected, *status);
+    if(s_reverse(expected) != crc)
+        return -1;
+    port->status = *status;
+    return 0;
+}
+
+int write_status(libth_port_t *port, unsigned char status) {
+    unsigned char check;
+    if(!port || port->fd < 0)
+        return -1;
+
+    status &= STATUS_WRITABLE;
+    if(send_command(port, STATUS_REG_W) || write_byte(port, status))
+        return -1;
+    // Verify the sensor took it, read also updates the cached copy
+    if(read_status(port, &check) || (check & STATUS_WRITABLE) != status)
+        return -1;
+    return 0;
+}
+
+int libth_port_set_resolution(libth_port_t *port, bool low_res) {
+    if(!port || port->fd < 0)
+        return -1;
+    unsigned char status = port->status & STATUS_WRITABLE;
+    if(low_res)
+        status |= STATUS_LOW_RES;
+    else
+        status &= ~STATUS_LOW_RES;
+    return write_status(port, status);
+}
+
+//  Candidate half periods (us) from the slowest one
+static const unsigned int s_half_periods[] = { LIBTH_HALF_PERIOD, 500, 200, 100, 50, 20, 10 };
+#define HALF_PERIODS (sizeof(s_half_periods) / sizeof(s_half_periods[0]))
+
+int libth_port_calibrate(libth_port_t *port) {
+    unsigned char status;
+    size_t fastest = HALF_PERIODS;
+    if(!port || port->fd < 0)
+        return -1;
+
+    for(size_t i = 0; i < HALF_PERIODS; i++) {
+        port->half_period = s_half_periods[i];
+        int round = 0;
+        while(round < LIBTH_CALIBRATION_ROUNDS && read_status(port, &status) == 0)
+            round++;
+        // status read broken off by cancellation doesn't fail the candidate
+        if(s_check_cancel(port)) {
+            port->half_period = LIBTH_HALF_PERIOD;
+            return -1;
+        }
+        if(round < LIBTH_CALIBRATION_ROUNDS)
+            break;
+        fastest = i;
     }
-    return ret;
+
+    if(fastest == HALF_PERIODS) {
+        port->half_period = LIBTH_HALF_PERIOD;
+        reset_device(port);
+        return -1;
+    }
+    // Keep margin, one step slower than what just passed
+    port->half_period = s_half_periods[fastest > 0 ? fastest - 1 : 0];
+    // Failed candidate could leave the sensor in the middle of transfer
+    reset_device(port);
+    return 0;
+}
+
+void libth_port_backoff(libth_port_t *port) {
+    if(!port)
+        return;
+    port->half_period *= 2;
+    if(port->half_period > LIBTH_HALF_PERIOD || port->half_period == 0)
+        port->half_period = LIBTH_HALF_PERIOD;
+}
+
+//  Check CRC the sensor sent after the conversion result
+static bool s_conversion_crc_ok(libth_port_t *port, unsigned char what,
+        const unsigned char *data, unsigned char crc) {
+    unsigned char expected = s_crc8(s_crc_init(port->status), what);
+    expected = s_crc8(expected, data[0]);
+    expected = s_crc8(expected, data[1]);
+    return s_reverse(expected) == crc;
 }
 
-int get_th_data(int fd, unsigned char what) {
+//  One conversion, returns the raw value, -1 on failure and
+//  LIBTH_CRC_MISMATCH if the result got corrupted on the way
+static int s_conversion(libth_port_t *port, unsigned char what) {
     unsigned char tmp[2];
     unsigned char crc;
 
-    if(fd < 0)
+    if(send_command(port, what)) {
+        if(s_check_cancel(port))
+            return -1;
+        // Missing ACK, sensor didn't get the command at current speed
+        libth_port_backoff(port);
+        return -1;
+    }
+
+    if(wait_conversion(port, port->conversion_timeout))
         return -1;
 
-    command_start(fd);
-    if(write_byte(fd, what))
+    read_byte(port, tmp,   1);
+    read_byte(port, tmp+1, 1);
+    // no ACK after CRC ends the transmission
+    read_byte(port, &crc,  0);
+    // Transfer broken off by cancellation says nothing about the speed
+    if(s_check_cancel(port))
         return -1;
+    if(!s_conversion_crc_ok(port, what, tmp, crc)) {
+        // Corrupted transfer, typical of SCK faster than the sensor takes,
+        // it is repeated slower
+        libth_port_backoff(port);
+        return LIBTH_CRC_MISMATCH;
+    }
+    return ((int)tmp[0])*256 + (int)tmp[1];
+}
 
-    msleep(50);
+int get_th_data(libth_port_t *port, unsigned char what) {
+    if(!port || port->fd < 0)
+        return -1;
 
-    for(int i=0;i<100000 && get_rx(fd); i++)
-        usleep(100);
+    for(int attempt = 0; ; attempt++) {
+        if(s_check_cancel(port))
+            return -1;
+        int rv = s_conversion(port, what);
+        if(rv >= 0) {
+            port->stats.readings++;
+            return rv;
+        }
+        // Cancelled reading didn't fail on its own
+        if(s_check_cancel(port))
+            return -1;
+        if(rv == LIBTH_CRC_MISMATCH)
+            port->stats.crc_errors++;
+        // Only corrupted transfer is worth repeating right away, line
+        // is idle again after it
+        if(rv != LIBTH_CRC_MISMATCH || attempt >= LIBTH_CRC_RETRIES) {
+            port->stats.failures++;
+            return -1;
+        }
+        port->stats.retries++;
+    }
+}
+
+int get_th_pair(libth_port_t *port, th_sample_t *sample) {
+    if(!port || port->fd < 0 || !sample)
+        return -1;
 
-    if(get_rx(fd))
+    sample->raw_T = get_th_data(port, MEASURE_TEMP);
+    if(sample->raw_T < 0)
+        return -1;
+    sample->raw_H = get_th_data(port, MEASURE_HUMI);
+    if(sample->raw_H < 0)
         return -1;
 
-    read_byte(fd, tmp,   1);
-    read_byte(fd, tmp+1, 1);
-    read_byte(fd, &crc,  1);
-    return ((int)tmp[0])*255 + (int)tmp[1];
+    bool low_res = port->status & STATUS_LOW_RES;
+    compensate_temp(sample->raw_T, low_res, &sample->T);
+    // Humidity compensation needs real temperature
+    compensate_humidity(sample->raw_H, sample->T, low_res, &sample->H);
+    sample->count = 1;
+    sample->T_spread = 0;
+    sample->H_spread = 0;
+    return 0;
 }
 
-int device_connected(int fd) {
-    int bytes = 0;
+//  Sort few values in place
+static void s_sort(int32_t *values, size_t count) {
+    for(size_t i = 1; i < count; i++) {
+        int32_t value = values[i];
+        size_t j = i;
+        for(; j > 0 && values[j - 1] > value; j--)
+            values[j] = values[j - 1];
+        values[j] = value;
+    }
+}
+
+//  Reduce sorted values
+static int32_t s_reduce(const int32_t *values, size_t count, th_reduction_t reduction) {
+    if(reduction == TH_REDUCE_TRIMMED_MEAN) {
+        size_t trim = count / 4;
+        int64_t sum = 0;
+        for(size_t i = trim; i < count - trim; i++)
+            sum += values[i];
+        int64_t n = count - 2 * trim;
+        // round half away from zero
+        return (int32_t)((sum + (sum < 0 ? -n / 2 : n / 2)) / n);
+    }
+    if(count % 2)
+        return values[count / 2];
+    int64_t sum = (int64_t)values[count / 2 - 1] + values[count / 2];
+    return (int32_t)(sum / 2);
+}
+
+void th_sample_reduce(const th_sample_t *samples, size_t count,
+        th_reduction_t reduction, th_sample_t *out) {
+    int32_t values[4][LIBTH_MAX_OVERSAMPLING];
+    if(!samples || !out || count == 0)
+        return;
+    if(count > LIBTH_MAX_OVERSAMPLING)
+        count = LIBTH_MAX_OVERSAMPLING;
+
+    for(size_t i = 0; i < count; i++) {
+        values[0][i] = samples[i].raw_T;
+        values[1][i] = samples[i].raw_H;
+        values[2][i] = samples[i].T;
+        values[3][i] = samples[i].H;
+    }
+    for(int v = 0; v < 4; v++)
+        s_sort(values[v], count);
+    out->raw_T = s_reduce(values[0], count, reduction);
+    out->raw_H = s_reduce(values[1], count, reduction);
+    out->T = s_reduce(values[2], count, reduction);
+    out->H = s_reduce(values[3], count, reduction);
+    out->count = count;
+    out->T_spread = values[2][count - 1] - values[2][0];
+    out->H_spread = values[3][count - 1] - values[3][0];
+}
+
+int get_th_oversampled(libth_port_t *port, unsigned int count,
+        th_reduction_t reduction, th_sample_t *sample) {
+    th_sample_t samples[LIBTH_MAX_OVERSAMPLING];
+    size_t done = 0;
+    if(!port || port->fd < 0 || !sample)
+        return -1;
+    if(count > LIBTH_MAX_OVERSAMPLING)
+        count = LIBTH_MAX_OVERSAMPLING;
+
+    // Session is open and line idle, conversions go back to back
+    while(done < count && get_th_pair(port, &samples[done]) == 0)
+        done++;
+    if(done == 0)
+        return -1;
+    th_sample_reduce(samples, done, reduction, sample);
+    return 0;
+}
+
+/*
+ Presence probe, sensor answers with zero byte to break
+                              ______________________
+ BREAK: ______________________|
+        |<- PROBE_STEP ->|<- PROBE_STEP ->| check input
+*/
+
+int presence_probe_step(libth_port_t *port, presence_probe_t *probe, int64_t now) {
     char buf = 'x';
-    if(fd < 0)
+    if(!port || !probe)
+        return -1;
+    if(port->fd < 0) {
+        // port is closed or failed, owner reopens it before probing again
+        probe->state = PRESENCE_PROBE_IDLE;
+        return -1;
+    }
+
+    switch(probe->state) {
+        case PRESENCE_PROBE_IDLE:
+            break;
+        case PRESENCE_PROBE_BREAK_CLEARED:
+        case PRESENCE_PROBE_BREAK_SET:
+            if(now < probe->deadline)
+                return PRESENCE_PENDING;
+            break;
+    }
+
+    // Failing ioctl means the port itself went away, let the owner of
+    // the descriptor decide whether to reopen it
+    switch(probe->state) {
+        case PRESENCE_PROBE_IDLE:
+            if(port->transport->set_break(port, 0) < 0)
+                goto probe_err;
+            probe->state = PRESENCE_PROBE_BREAK_CLEARED;
+            probe->deadline = now + PRESENCE_PROBE_STEP;
+            return PRESENCE_PENDING;
+        case PRESENCE_PROBE_BREAK_CLEARED:
+            if(port->transport->set_break(port, 1) < 0)
+                goto probe_err;
+            probe->state = PRESENCE_PROBE_BREAK_SET;
+            probe->deadline = now + PRESENCE_PROBE_STEP;
+            return PRESENCE_PENDING;
+        case PRESENCE_PROBE_BREAK_SET:
+            probe->state = PRESENCE_PROBE_IDLE;
+            switch(port->transport->read_input(port, &buf)) {
+                case -1:
+                    return -1;
+                case 1:
+                    return buf == '\0';
+                default:
+                    return false;
+            }
+    }
+probe_err:
+    probe->state = PRESENCE_PROBE_IDLE;
+    return -1;
+}
+
+int device_connected(libth_port_t *port) {
+    presence_probe_t probe = { PRESENCE_PROBE_IDLE, 0 };
+    int rv;
+    while((rv = presence_probe_step(port, &probe, zclock_mono())) == PRESENCE_PENDING) {
+        if(s_check_cancel(port))
+            return -1;
+        int64_t wait = probe.deadline - zclock_mono();
+        if(wait > 0)
+            msleep(s_cancel_slice(wait));
+    }
+    return rv;
+}
+
+int open_device(libth_port_t *port) {
+    if(!port || !port->path)
+        return -1;
+    if(port->fd >= 0)
+        return 0;
+    if(port->transport->open(port) < 0)
+        return -1;
+
+    // Cache of modem lines, DATA and SCK are then set at once
+    port->lines = 0;
+    port->transport->get_lines(port, &port->lines);
+    port->clock = (port->lines & TIOCM_RTS) ? 1 : 0;
+    reset_device(port);
+
+    return 0;
+}
+
+void close_device(libth_port_t *port) {
+    if(!port || port->fd < 0)
+        return;
+    port->transport->close(port);
+    port->fd = -1;
+}
+
+/*
+ Serial device transport. Waiting for modem line change can't time out
+ on its own. The calling thread gets a timer which interrupts TIOCMIWAIT
+ by signal at deadline and then periodically, in case the signal came
+ just before the wait. Signal the host application handles itself is
+ never taken over, waits poll modem lines instead.
+*/
+
+static void s_wakeup_handler(int signo) {
+    // just interrupt the system call
+}
+
+static pthread_once_t s_wakeup_once = PTHREAD_ONCE_INIT;
+static int s_wakeup_signal = -1;    // -1 until set, 0 if waits don't use signal
+static bool s_wakeup_ready = false; // handler of the signal is installed
+
+void libth_set_wakeup_signal(int signo) {
+    s_wakeup_signal = signo;
+}
+
+//  Return true if nobody handles the signal yet
+static bool s_wakeup_signal_free(int signo) {
+    struct sigaction old;
+    if(sigaction(signo, NULL, &old) < 0)
         return false;
-    if(ioctl(fd, TIOCCBRK) < 0)
-        goto dev_con_err;
-    sleep(1);
-    if(ioctl(fd, TIOCSBRK) < 0)
-        goto dev_con_err;
-    sleep(1);
-    if(ioctl(fd, TIOCINQ, &bytes) < 0)
-        goto dev_con_err;
-    if(bytes > 0 && read(fd, &buf, 1) && buf == '\0')
-        return true;
-    return false;
-dev_con_err:
-    close(fd);
-    return false;
-}
-
-int open_device(const char* dev) {
-    int fd = open(dev, O_RDWR);
-    if(fd < 0)
-        return fd;
+    return !(old.sa_flags & SA_SIGINFO) && old.sa_handler == SIG_DFL;
+}
+
+static void s_wakeup_init(void) {
+    if(s_wakeup_signal < 0)
+        s_wakeup_signal = LIBTH_WAKEUP_SIGNAL;
+    if(s_wakeup_signal == 0 || !s_wakeup_signal_free(s_wakeup_signal))
+        return;
+    struct sigaction action;
+    action.sa_handler = s_wakeup_handler;
+    // no SA_RESTART, blocking ioctl must return EINTR
+    action.sa_flags = 0;
+    sigemptyset(&action.sa_mask);
+    s_wakeup_ready = sigaction(s_wakeup_signal, &action, NULL) == 0;
+}
+
+static int s_wakeup_arm(libth_port_t *port, unsigned int timeout) {
+    pid_t tid = (pid_t) syscall(SYS_gettid);
+    if(port->wakeup_tid != tid) {
+        // timer signals only the thread which created it
+        if(port->wakeup_tid)
+            timer_delete(port->wakeup);
+        port->wakeup_tid = 0;
+        pthread_once(&s_wakeup_once, s_wakeup_init);
+        if(!s_wakeup_ready) {
+            // waits fall back to polling
+            errno = EBUSY;
+            return -1;
+        }
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = s_wakeup_signal;
+        sev.sigev_notify_thread_id = tid;
+        if(timer_create(CLOCK_MONOTONIC, &sev, &port->wakeup) < 0)
+            return -1;
+        port->wakeup_tid = tid;
+    }
+    struct itimerspec its;
+    its.it_value.tv_sec = timeout / 1000;
+    its.it_value.tv_nsec = (timeout % 1000) * 1000000L + 1;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = LIBTH_WAKEUP_RECHECK * 1000000L;
+    return timer_settime(port->wakeup, 0, &its, NULL);
+}
+
+static void s_wakeup_disarm(libth_port_t *port) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if(port->wakeup_tid)
+        timer_settime(port->wakeup, 0, &its, NULL);
+}
+
+static int s_serial_open(libth_port_t *port) {
+    port->fd = open(port->path, O_RDWR);
+    if(port->fd < 0)
+        return -1;
 
     // Set connection parameters
-    ioctl(fd, TIOCRS232);
+    ioctl(port->fd, TIOCRS232);
     struct termios termios_s;
-    tcgetattr(fd, &termios_s);
+    tcgetattr(port->fd, &termios_s);
     termios_s.c_iflag &= ~(IGNBRK | BRKINT | PARMRK);
     termios_s.c_lflag &= ~ICANON;
-    tcsetattr(fd, TCSANOW, &termios_s);
+    tcsetattr(port->fd, TCSANOW, &termios_s);
 
     //Flush all serial port buffers
-    tcflush(fd, TCIOFLUSH);
+    tcflush(port->fd, TCIOFLUSH);
+    return 0;
+}
+
+static void s_serial_close(libth_port_t *port) {
+    close(port->fd);
+    port->fd = -1;
+}
+
+static int s_serial_set_lines(libth_port_t *port, int lines) {
+    return ioctl(port->fd, TIOCMSET, &lines) < 0 ? -1 : 0;
+}
+
+static int s_serial_get_lines(libth_port_t *port, int *lines) {
+    return ioctl(port->fd, TIOCMGET, lines) < 0 ? -1 : 0;
+}
+
+static int s_serial_wait_lines(libth_port_t *port, int mask, unsigned int timeout) {
+    if(s_wakeup_arm(port, timeout) < 0)
+        return -1;
+    int rv = ioctl(port->fd, TIOCMIWAIT, mask) < 0 ? -1 : 0;
+    int err = errno;
+    s_wakeup_disarm(port);
+    errno = err;
+    return rv;
+}
+
+static int s_serial_set_break(libth_port_t *port, int on) {
+    return ioctl(port->fd, on ? TIOCSBRK : TIOCCBRK) < 0 ? -1 : 0;
+}
+
+static int s_serial_read_input(libth_port_t *port, char *byte) {
+    int bytes = 0;
+    if(ioctl(port->fd, TIOCINQ, &bytes) < 0)
+        return -1;
+    if(bytes > 0 && read(port->fd, byte, 1) == 1)
+        return 1;
+    return 0;
+}
+
+static int s_serial_get_counters(libth_port_t *port, unsigned int *transitions) {
+    struct serial_icounter_struct icount;
+    if(ioctl(port->fd, TIOCGICOUNT, &icount) < 0)
+        return -1;
+    // GPI 1 is DSR, GPI 2 DCD
+    transitions[0] = (unsigned int) icount.dsr;
+    transitions[1] = (unsigned int) icount.dcd;
+    return 0;
+}
+
+static const libth_transport_t s_serial_transport = {
+    s_serial_open,
+    s_serial_close,
+    s_serial_set_lines,
+    s_serial_get_lines,
+    s_serial_wait_lines,
+    s_serial_set_break,
+    s_serial_read_input,
+    s_serial_get_counters
+};
+
+void libth_port_set_transport(libth_port_t *port, const libth_transport_t *transport, void *data) {
+    if(!port)
+        return;
+    assert(port->fd < 0);
+    port->transport = transport ? transport : &s_serial_transport;
+    port->transport_data = transport ? data : NULL;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new port context, device is not opened yet
+
+libth_port_t *
+libth_port_new (const char *dev)
+{
+    libth_port_t *self = (libth_port_t *) zmalloc (sizeof (libth_port_t));
+    if (!self)
+        return NULL;
+    self->path = dev ? strdup (dev) : NULL;
+    self->transport = &s_serial_transport;
+    self->transport_data = NULL;
+    self->fd = -1;
+    self->clock = 1;
+    self->lines = 0;
+    self->half_period = LIBTH_HALF_PERIOD;
+    self->status = 0;
+    self->conversion_timeout = LIBTH_CONVERSION_TIMEOUT;
+    self->wakeup_tid = 0;
+    self->cancel = NULL;
+    return self;
+}
+
 
-    reset_device(fd);
+//  --------------------------------------------------------------------------
+//  Destroy the port context, closes the device
 
-    return fd;
+void
+libth_port_destroy (libth_port_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        libth_port_t *self = *self_p;
+        close_device (self);
+        if (self->wakeup_tid)
+            timer_delete (self->wakeup);
+        free (self->path);
+        free (self);
+        *self_p = NULL;
+    }
 }
 
 
 //  --------------------------------------------------------------------------
 //  Self test of this class
 
+//  Compensation as it was done in double
+static int32_t
+s_test_compensate_humidity_double (int H, int T, bool low_res)
+{
+    double tmp = H;
+    if (low_res) {
+        tmp = -2.0468 + 0.5872 * tmp - 4.0845E-4 * tmp * tmp;
+        tmp = ((double)T/100 - 25.0)*(0.01 + 0.00128 * (double)H) + tmp;
+    } else {
+        tmp = -2.0468 + 0.0367 * tmp - 1.5955E-6 * tmp * tmp;
+        tmp = ((double)T/100 - 25.0)*(0.01 + 0.00008 * (double)H) + tmp;
+    }
+    return tmp * 100;
+}
+
+//  Exact hundredths when the exact result is a whole number of them
+static int32_t
+s_test_compensate_humidity_exact (int H, int T, bool low_res)
+{
+    int64_t S = H;
+    int64_t x = low_res ?
+        -20468LL * 100000000 + 5872LL * 100000000 * S - 40845LL * 10000 * S * S +
+            (int64_t) (T - 2500) * (100000000LL + 128LL * 100000 * S) :
+        -20468LL * 100000000 + 367LL * 100000000 * S - 15955LL * 100 * S * S +
+            (int64_t) (T - 2500) * (100000000LL + 8LL * 100000 * S);
+    assert (0 == x % 10000000000LL);
+    return (int32_t) (x / 10000000000LL);
+}
+
 void
 libth_test (bool verbose)
 {
     printf (" * libth: ");
     // put some real test here
     printf("Verifying read_gpi fails with invalid file descriptor.\n");
-    assert(-1 == read_gpi(-1, 1));
+    assert(-1 == read_gpi(NULL, 1));
+    libth_port_t *port = libth_port_new("/nonexistent/ttySTH1");
+    assert(port);
+    assert(-1 == port->fd);
+    assert(-1 == open_device(port));
+    assert(-1 == read_gpi(port, 1));
+    assert(-1 == read_gpi_lines(port));
+    assert(-1 == wait_gpi(port, 10));
+    unsigned int transitions[GPI_PORTS];
+    assert(-1 == read_gpi_counters(port, transitions));
+    printf("Verifying GPI states are taken out of one snapshot.\n");
+    assert(1 == gpi_from_lines(GPI_LINES_MASK, 1) && 1 == gpi_from_lines(GPI_LINES_MASK, 2));
+    assert(1 == gpi_from_lines(GPI_PORT1_MASK | TIOCM_CTS, 1));
+    assert(0 == gpi_from_lines(GPI_PORT1_MASK, 2));
+    assert(-1 == gpi_from_lines(GPI_LINES_MASK, 3));
+    printf("Verifying get_th_pair fails with invalid file descriptor.\n");
+    th_sample_t sample;
+    assert(-1 == get_th_pair(port, &sample));
+    printf("Verifying presence probe fails with invalid file descriptor.\n");
+    presence_probe_t probe = { PRESENCE_PROBE_IDLE, 0 };
+    assert(-1 == presence_probe_step(port, &probe, zclock_mono()));
+    assert(-1 == presence_probe_step(NULL, &probe, zclock_mono()));
+    assert(-1 == device_connected(port)); // verify port is reported failed, not empty
+    assert(PRESENCE_PROBE_IDLE == probe.state);
+    libth_port_destroy(&port);
+    assert(NULL == port);
+    libth_port_destroy(&port);
+
+    printf("Verifying conversion wait times out on device without modem lines.\n");
+    port = libth_port_new("/dev/null");
+    assert(port);
+    port->fd = open(port->path, O_RDWR);
+    assert(port->fd >= 0);
+    int64_t start = zclock_mono();
+    assert(-1 == wait_conversion(port, 50));
+    assert(zclock_mono() - start >= 50);
+    assert(zclock_mono() - start < 1000);
+
+    printf("Verifying wakeup signal handled by host is left alone.\n");
+    struct sigaction host, saved;
+    memset(&host, 0, sizeof(host));
+    host.sa_handler = s_wakeup_handler;
+    sigemptyset(&host.sa_mask);
+    assert(0 == sigaction(SIGRTMIN + 5, &host, &saved));
+    assert(!s_wakeup_signal_free(SIGRTMIN + 5));
+    assert(0 == sigaction(SIGRTMIN + 5, &saved, NULL));
+    assert(s_wakeup_signal_free(SIGRTMIN + 5));
+
+    printf("Verifying SCK half period is kept.\n");
+    port->half_period = 2000;
+    start = zclock_usecs();
+    for(int i = 0; i < 5; i++)
+        long_tick(port, -1);
+    assert(zclock_usecs() - start >= 5 * 2000);
+
+    printf("Verifying calibration falls back to default without sensor.\n");
+    port->half_period = 10;
+    assert(-1 == libth_port_calibrate(port));
+    assert(LIBTH_HALF_PERIOD == port->half_period);
+    unsigned char status;
+    assert(-1 == read_status(port, &status));
+
+    printf("Verifying back off up to default half period.\n");
+    port->half_period = 10;
+    libth_port_backoff(port);
+    assert(20 == port->half_period);
+    port->half_period = LIBTH_HALF_PERIOD / 2 + 1;
+    libth_port_backoff(port);
+    assert(LIBTH_HALF_PERIOD == port->half_period);
+    libth_port_backoff(port);
+    assert(LIBTH_HALF_PERIOD == port->half_period);
+
+    printf("Verifying command waveforms.\n");
+    pthread_once(&s_waves_once, s_waves_init);
+    for(size_t i = 0; i < COMMAND_WAVES; i++) {
+        const wave_t *wave = &s_command_waves[i].wave;
+        // start, 8 bits and ACK clock, two edges each
+        assert(7 + 2 * 8 + 2 == wave->length);
+        unsigned char command = 0;
+        int sck = 0;
+        for(size_t e = 0; e < wave->length; e++) {
+            unsigned char edge = wave->edges[e];
+            assert(edge & WAVE_WAIT);
+            // bits are clocked in by rising SCK after the start
+            if(e >= 7 && (edge & WAVE_SCK) && !sck && e < 7 + 16)
+                command = (command << 1) | (edge & WAVE_TX ? 1 : 0);
+            sck = edge & WAVE_SCK;
+        }
+        assert(s_command_waves[i].command == command);
+        assert(wave->edges[7 + 16] == (WAVE_TX | WAVE_SCK | WAVE_WAIT | WAVE_ACK));
+    }
+    assert(1 + 2 * 9 + 7 == s_reset_wave.length);
+    port->half_period = 1;
+    // no sensor on /dev/null, nobody acknowledges
+    assert(1 == send_command(port, MEASURE_TEMP));
+    assert(1 == send_command(port, 0x55));
+    assert(0 == port->clock);
+
+    printf("Verifying resolution can't be set without sensor.\n");
+    port->status = 0;
+    assert(-1 == libth_port_set_resolution(port, true));
+    assert(0 == port->status);
+
+    printf("Verifying failed readings are counted.\n");
+    memset(&port->stats, 0, sizeof(port->stats));
+    assert(-1 == get_th_data(port, MEASURE_TEMP));
+    assert(1 == port->stats.failures);
+    assert(0 == port->stats.crc_errors && 0 == port->stats.retries);
+
+    printf("Verifying status CRC.\n");
+    assert(0 == s_crc_init(0x40));
+    assert(0x80 == s_crc_init(STATUS_LOW_RES));
+    assert(0x31 == s_crc8(0, 0x01));
+    for(int i = 0; i < 256; i++) {
+        unsigned char crc = i;
+        for(int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : crc << 1;
+        assert(crc == s_crc_table[i]);
+    }
+    // reading of 0x0312 for MEASURE_TEMP with full resolution
+    unsigned char frame[2] = { 0x03, 0x12 };
+    unsigned char frame_crc = s_reverse(s_crc8(s_crc8(s_crc8(0, MEASURE_TEMP), 0x03), 0x12));
+    port->status = 0;
+    assert(s_conversion_crc_ok(port, MEASURE_TEMP, frame, frame_crc));
+    assert(!s_conversion_crc_ok(port, MEASURE_HUMI, frame, frame_crc));
+    frame[1] ^= 0x04;
+    assert(!s_conversion_crc_ok(port, MEASURE_TEMP, frame, frame_crc));
+    frame[1] ^= 0x04;
+    port->status = STATUS_LOW_RES; // seed differs in low resolution
+    assert(!s_conversion_crc_ok(port, MEASURE_TEMP, frame, frame_crc));
+    assert(0x01 == s_reverse(0x80));
+    libth_port_destroy(&port);
+
+    printf("Verifying fixed point compensation against double formula.\n");
+    for(int low_res = 0; low_res < 2; low_res++) {
+        int max_H = low_res ? 256 : 4096;
+        for(int raw_H = 0; raw_H < max_H; raw_H++) {
+            for(int T = -4010; T <= 12000; T += 37) {
+                int32_t fixed;
+                compensate_humidity(raw_H, T, low_res, &fixed);
+                int32_t reference = s_test_compensate_humidity_double(raw_H, T, low_res);
+                if(fixed != reference) {
+                    // double rounds below exact hundredths sometimes, fixed
+                    // point is then one up and exactly on the boundary
+                    assert(fixed == reference + 1);
+                    assert(fixed == s_test_compensate_humidity_exact(raw_H, T, low_res));
+                }
+            }
+        }
+    }
+
+    printf("Verifying batch compensation.\n");
+    int batch_T[64], batch_H[64];
+    int32_t batch_cT[64], batch_cH[64];
+    for(int i = 0; i < 64; i++) {
+        batch_T[i] = 5000 + i * 37;
+        batch_H[i] = 100 + i * 61;
+    }
+    compensate_th_batch(batch_T, batch_H, 64, false, batch_cT, batch_cH);
+    for(int i = 0; i < 64; i++) {
+        int32_t T1, H1;
+        compensate_temp(batch_T[i], false, &T1);
+        compensate_humidity(batch_H[i], T1, false, &H1);
+        assert(T1 == batch_cT[i] && H1 == batch_cH[i]);
+    }
+    compensate_th_batch(batch_T, batch_H, 64, true, batch_cT, batch_cH);
+    for(int i = 0; i < 64; i++) {
+        int32_t T1, H1;
+        compensate_temp(batch_T[i], true, &T1);
+        compensate_humidity(batch_H[i], T1, true, &H1);
+        assert(T1 == batch_cT[i] && H1 == batch_cH[i]);
+    }
+
+    if(verbose) {
+        // microbenchmark, volatile sink keeps the loops alive
+        volatile int32_t sink = 0;
+        int rounds = 100000;
+        int64_t start_us = zclock_usecs();
+        for(int i = 0; i < rounds; i++)
+            sink += s_test_compensate_humidity_double(i & 4095, 2500 + (i & 1023), false);
+        int64_t double_us = zclock_usecs() - start_us;
+        start_us = zclock_usecs();
+        for(int i = 0; i < rounds; i++) {
+            int32_t out;
+            compensate_humidity(i & 4095, 2500 + (i & 1023), false, &out);
+            sink += out;
+        }
+        int64_t fixed_us = zclock_usecs() - start_us;
+        start_us = zclock_usecs();
+        for(int i = 0; i < rounds; i += 64) {
+            compensate_th_batch(batch_T, batch_H, 64, false, batch_cT, batch_cH);
+            sink += batch_cH[i & 63];
+        }
+        int64_t batch_us = zclock_usecs() - start_us;
+        printf("%d humidity compensations: double %" PRId64 " us, fixed %" PRId64
+                " us, batch of T&H %" PRId64 " us\n", rounds, double_us, fixed_us, batch_us);
+    }
+
+    printf("Verifying reduction of oversampled readings.\n");
+    th_sample_t samples[LIBTH_MAX_OVERSAMPLING];
+    th_sample_t reduced;
+    int32_t noisy_T[] = { 2500, 2510, 9999, 2490, 2505 };
+    for(int i = 0; i < 5; i++) {
+        samples[i].raw_T = noisy_T[i] + 4010;
+        samples[i].raw_H = 1600 - i;
+        samples[i].T = noisy_T[i];
+        samples[i].H = 5000 + i * 10;
+    }
+    th_sample_reduce(samples, 5, TH_REDUCE_MEDIAN, &reduced);
+    assert(2505 == reduced.T && 2505 + 4010 == reduced.raw_T);
+    assert(5020 == reduced.H && 1598 == reduced.raw_H);
+    assert(5 == reduced.count);
+    assert(9999 - 2490 == reduced.T_spread && 40 == reduced.H_spread);
+    th_sample_reduce(samples, 5, TH_REDUCE_TRIMMED_MEAN, &reduced);
+    assert(2505 == reduced.T); // outlier is trimmed away
+    assert(5020 == reduced.H);
+    int32_t even_T[] = { 1, 2, 3, 10 };
+    for(int i = 0; i < 4; i++)
+        samples[i].T = -even_T[i];
+    th_sample_reduce(samples, 4, TH_REDUCE_MEDIAN, &reduced);
+    assert(-2 == reduced.T);
+    th_sample_reduce(samples, 4, TH_REDUCE_TRIMMED_MEAN, &reduced);
+    assert(-3 == reduced.T);
+    th_sample_reduce(samples, 1, TH_REDUCE_TRIMMED_MEAN, &reduced);
+    assert(-1 == reduced.T && 0 == reduced.T_spread && 1 == reduced.count);
+
+    printf("Verifying compensation of both resolutions.\n");
+    int32_t T, T_low, H, H_low;
+    compensate_temp(6510, false, &T);
+    assert(2500 == T);
+    compensate_temp(1628, true, &T_low);
+    assert(2502 == T_low);
+    // 8bit humidity counts 16 times coarser, same result at 25 C
+    compensate_humidity(1600, 2500, false, &H);
+    compensate_humidity(100, 2500, true, &H_low);
+    assert(H > 5200 && H < 5300);
+    assert(abs(H - H_low) <= 1);
     printf ("OK\n");
 }
@@ -30,15 +30,115 @@
 #define MEASURE_HUMI 0x05    //000   0010    1
 #define RESET        0x1e    //000   1111    0
 
+#define STATUS_LOW_RES  0x01    // 12bit temperature, 8bit humidity
+#define STATUS_WRITABLE 0x07    // heater, no reload and resolution bits
+
 #define GPI_PORT1_BITSHIFT  8
 #define GPI_PORT2_BITSHIFT  6
-#define GPI_PORT1_MASK      1 << GPI_PORT1_BITSHIFT
-#define GPI_PORT2_MASK      1 << GPI_PORT2_BITSHIFT
+#define GPI_PORT1_MASK      (1 << GPI_PORT1_BITSHIFT)
+#define GPI_PORT2_MASK      (1 << GPI_PORT2_BITSHIFT)
+#define GPI_LINES_MASK      (GPI_PORT1_MASK | GPI_PORT2_MASK)
+#define GPI_PORTS           2
+
+#define LIBTH_HALF_PERIOD   1000    // us, default and slowest half period of SCK
+#define LIBTH_CALIBRATION_ROUNDS 3  // status reads each half period must pass
+#define LIBTH_CONVERSION_TIMEOUT 1000   // ms, max time of one conversion
+#define LIBTH_CRC_RETRIES   2       // conversions repeated after CRC error, per reading
+#define LIBTH_CRC_MISMATCH  -2      // conversion result failed CRC check
+#define LIBTH_MAX_OVERSAMPLING 16   // max conversion pairs of one oversampled reading
+#define LIBTH_WAKEUP_SIGNAL (SIGRTMIN + 4)  // default signal interrupting waits for lines
+#define LIBTH_WAKEUP_RECHECK 20     // ms, period of wakeups after timeout
+#define LIBTH_GPI_POLL      10      // ms, GPI polling period of transports which can't wait
+#define LIBTH_CONVERSION_POLL 1     // ms, conversion polling period of transports which can't wait
+#define LIBTH_CANCEL_CHECK  20      // ms, longest wait before cancellation token is checked
+#define PRESENCE_PROBE_STEP 1000    // ms the line is held in each probe state
+#define PRESENCE_PENDING    2       // presence probe is still in flight
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+//  Communication counters of one serial port
+typedef struct _libth_stats_t {
+    unsigned int readings;      // conversions read successfully
+    unsigned int crc_errors;    // conversions failing CRC check
+    unsigned int retries;       // conversions repeated after CRC error
+    unsigned int failures;      // readings given up
+} libth_stats_t;
+
+typedef struct _libth_port_t libth_port_t;
+
+//  Access to device and modem lines (TIOCM_* bits) of the port. Functions
+//  return 0 on success, -1 with errno set on failure
+typedef struct _libth_transport_t {
+    //  Open port->path, sets port->fd
+    int  (*open) (libth_port_t *port);
+    //  Close port->fd, sets it to -1
+    void (*close) (libth_port_t *port);
+    //  Set output lines, DTR and RTS
+    int  (*set_lines) (libth_port_t *port, int lines);
+    //  Get state of all lines
+    int  (*get_lines) (libth_port_t *port, int *lines);
+    //  Wait for change of lines in mask at most timeout (ms). Fails with
+    //  ETIMEDOUT or EINTR, other errno means transport can't wait
+    int  (*wait_lines) (libth_port_t *port, int mask, unsigned int timeout);
+    //  Set (on) or clear break condition
+    int  (*set_break) (libth_port_t *port, int on);
+    //  Read one byte of input if there is any, returns 1 if read, 0 if none
+    int  (*read_input) (libth_port_t *port, char *byte);
+    //  Get numbers of transitions of GPI lines counted so far, indexed by
+    //  GPI - 1. Counters only grow until the port is reinitialized
+    int  (*get_counters) (libth_port_t *port, unsigned int *transitions);
+} libth_transport_t;
+
+//  Reentrant context of one serial port, each port can be driven
+//  from its own thread
+struct _libth_port_t {
+    char    *path;      // device file
+    const libth_transport_t *transport; // serial device unless set otherwise
+    void    *transport_data;    // owned by the transport
+    int     fd;         // opened device, -1 when closed
+    int     clock;      // last state of SCK line
+    int     lines;      // last state of modem lines set by TIOCMSET
+    unsigned int half_period;   // us, half period of SCK
+    struct timespec edge;       // monotonic time of last line change
+    unsigned char status;       // last verified status register of sensor
+    libth_stats_t stats;        // communication counters
+    unsigned int conversion_timeout;    // ms, max time of one conversion
+    timer_t wakeup;     // interrupts waits for modem lines
+    pid_t   wakeup_tid; // thread the wakeup timer signals, 0 if none
+    const int *cancel;  // cancellation token, NULL if port can't be cancelled
+};
+
+//  Temperature and humidity acquired in one session
+typedef struct _th_sample_t {
+    int     raw_T;  // raw temperature reading
+    int     raw_H;  // raw humidity reading
+    int32_t T;      // compensated temperature, hundredths of C
+    int32_t H;      // compensated humidity, hundredths of %
+    unsigned int count; // conversion pairs reduced into the sample
+    int32_t T_spread;   // max - min of reduced temperatures
+    int32_t H_spread;   // max - min of reduced humidities
+} th_sample_t;
+
+//  How oversampled readings are reduced into one
+typedef enum {
+    TH_REDUCE_MEDIAN = 0,       // median
+    TH_REDUCE_TRIMMED_MEAN      // mean without lowest and highest quarter
+} th_reduction_t;
+
+//  Non-blocking sensor presence probe
+typedef enum {
+    PRESENCE_PROBE_IDLE = 0,        // no probe in flight
+    PRESENCE_PROBE_BREAK_CLEARED,   // break cleared, waiting to set it
+    PRESENCE_PROBE_BREAK_SET        // break set, waiting for sensor to answer
+} presence_probe_state_t;
+
+typedef struct _presence_probe_t {
+    presence_probe_state_t state;
+    int64_t deadline;   // monotonic time (ms) of next probe step
+} presence_probe_t;
+
 //  @interface
 //  Create a new libth - not used for library
 //FTY_SENSOR_ENV_PRIVATE libth_t *
@@ -52,33 +152,159 @@ extern "C" {
 FTY_SENSOR_ENV_PRIVATE void
     libth_test (bool verbose);
 
-//  Open device for reading
+//  Create a new port context, device is not opened yet
+FTY_SENSOR_ENV_PRIVATE libth_port_t *
+    libth_port_new (const char *dev);
+
+//  Destroy the port context, closes the device
+FTY_SENSOR_ENV_PRIVATE void
+    libth_port_destroy (libth_port_t **self_p);
+
+//  Drive the port by another transport than the serial device, port must
+//  be closed. Passing NULL transport restores the serial device
+FTY_SENSOR_ENV_PRIVATE void
+    libth_port_set_transport (libth_port_t *port, const libth_transport_t *transport, void *data);
+
+//  Make blocking calls on the port give up once token is set by libth_cancel,
+//  token must outlive the port. NULL makes the port uncancellable
+FTY_SENSOR_ENV_PRIVATE void
+    libth_port_set_cancel (libth_port_t *port, const int *token);
+
+//  Set cancellation token, can be called from any thread. Waits on ports
+//  using the token return within LIBTH_CANCEL_CHECK ms, transfers stop at
+//  the next SCK edge, following calls fail right away with ECANCELED until
+//  the token is cleared
+FTY_SENSOR_ENV_PRIVATE void
+    libth_cancel (int *token);
+
+//  Clear cancellation token, ports using it can be driven again
+FTY_SENSOR_ENV_PRIVATE void
+    libth_cancel_clear (int *token);
+
+//  Return true if cancellation token of the port is set
+FTY_SENSOR_ENV_PRIVATE bool
+    libth_port_cancelled (const libth_port_t *port);
+
+//  Set signal interrupting waits of serial ports for modem lines, call it
+//  before any port is opened. By default LIBTH_WAKEUP_SIGNAL is used. libth
+//  installs process-wide handler of the signal, unless the application
+//  already handles it, 0 makes the waits poll modem lines instead
+FTY_SENSOR_ENV_PRIVATE void
+    libth_set_wakeup_signal (int signo);
+
+//  Open port device for reading and reset attached sensor.
+//  Returns 0 on success, -1 on failure
+FTY_SENSOR_ENV_PRIVATE int
+    open_device (libth_port_t *port);
+
+//  Close port device, it can be opened again
+FTY_SENSOR_ENV_PRIVATE void
+    close_device (libth_port_t *port);
+
+//  Check if device is connected. Returns true/false, -1 if the port failed.
+//  Blocks for the whole probe, see presence_probe_step for async variant
 FTY_SENSOR_ENV_PRIVATE int
-    open_device (const char* dev);
+    device_connected (libth_port_t *port);
 
-//  Check if device is connected
+//  Advance presence probe, never blocks. Starts a new probe if none is in
+//  flight and moves it on once its deadline passed. Returns PRESENCE_PENDING
+//  while in flight, true/false when finished, -1 if the port failed
 FTY_SENSOR_ENV_PRIVATE int
-    device_connected (int fd);
+    presence_probe_step (libth_port_t *port, presence_probe_t *probe, int64_t now);
 
 //  Reset connected device
 FTY_SENSOR_ENV_PRIVATE void
-    reset_device (int fd);
+    reset_device (libth_port_t *port);
+
+//  Find the shortest half period of SCK the sensor reliably talks with.
+//  Every candidate must pass status register reads with ACK and CRC, the
+//  port then runs one step slower than the fastest passing candidate.
+//  Returns 0 on success, -1 if the sensor doesn't answer even at default
+FTY_SENSOR_ENV_PRIVATE int
+    libth_port_calibrate (libth_port_t *port);
+
+//  Slow SCK down after a communication error, up to the default
+FTY_SENSOR_ENV_PRIVATE void
+    libth_port_backoff (libth_port_t *port);
+
+//  Read status register of the sensor, verifying ACK and CRC.
+//  Returns 0 on success, -1 on failure
+FTY_SENSOR_ENV_PRIVATE int
+    read_status (libth_port_t *port, unsigned char *status);
 
-//  Get data from device (temperature, humidity)
+//  Write status register of the sensor and verify it by reading it back.
+//  Returns 0 on success, -1 on failure
 FTY_SENSOR_ENV_PRIVATE int
-    get_th_data (int fd, unsigned char what);
+    write_status (libth_port_t *port, unsigned char status);
+
+//  Switch sensor between full (14bit T, 12bit RH) and low (12bit T, 8bit RH)
+//  resolution, low one converts about 4x faster. Compensation of following
+//  readings follows the verified mode. Returns 0 on success, -1 on failure
+FTY_SENSOR_ENV_PRIVATE int
+    libth_port_set_resolution (libth_port_t *port, bool low_res);
+
+//  Get data from device (temperature, humidity). Result is verified by CRC,
+//  corrupted conversion is repeated up to LIBTH_CRC_RETRIES times. Missing
+//  ACK and corrupted result slow SCK down by libth_port_backoff.
+//  Returns raw reading, -1 on failure
+FTY_SENSOR_ENV_PRIVATE int
+    get_th_data (libth_port_t *port, unsigned char what);
+
+//  Get both temperature and humidity from device, one conversion each.
+//  Returns 0 on success, -1 on failure
+FTY_SENSOR_ENV_PRIVATE int
+    get_th_pair (libth_port_t *port, th_sample_t *sample);
+
+//  Get count (up to LIBTH_MAX_OVERSAMPLING) temperature and humidity pairs
+//  back to back and reduce them into one sample with the spread. Stops on
+//  first failing pair, sample->count tells how many were reduced.
+//  Returns 0 if at least one pair was read, -1 on failure
+FTY_SENSOR_ENV_PRIVATE int
+    get_th_oversampled (libth_port_t *port, unsigned int count,
+        th_reduction_t reduction, th_sample_t *sample);
+
+//  Reduce count samples into one, raw and compensated values separately
+FTY_SENSOR_ENV_PRIVATE void
+    th_sample_reduce (const th_sample_t *samples, size_t count,
+        th_reduction_t reduction, th_sample_t *out);
 
 //  Fix humidity reading
 FTY_SENSOR_ENV_PRIVATE void
-    compensate_humidity (int H, int T, int32_t* out);
+    compensate_humidity (int H, int T, bool low_res, int32_t* out);
 
 //  Fix temperature reading
 FTY_SENSOR_ENV_PRIVATE void
-    compensate_temp (int in, int32_t *out);
+    compensate_temp (int in, bool low_res, int32_t *out);
+
+//  Fix arrays of raw temperature and humidity readings, for processing of
+//  stored samples. Results are the same as of compensate_temp/humidity
+FTY_SENSOR_ENV_PRIVATE void
+    compensate_th_batch (const int *raw_T, const int *raw_H, size_t count,
+        bool low_res, int32_t *T, int32_t *H);
 
 //  Read GPI from connected device
 FTY_SENSOR_ENV_PRIVATE int
-    read_gpi(int fd, int port);
+    read_gpi (libth_port_t *port, int gpi);
+
+//  Read all GPI inputs of connected device at once, returns snapshot
+//  of the modem lines carrying them (GPI_LINES_MASK) or -1 on failure
+FTY_SENSOR_ENV_PRIVATE int
+    read_gpi_lines (libth_port_t *port);
+
+//  Get state of GPI (1, 2) out of snapshot, -1 for unknown GPI
+FTY_SENSOR_ENV_PRIVATE int
+    gpi_from_lines (int lines, int gpi);
+
+//  Read numbers of transitions of both GPI inputs (transitions[gpi - 1])
+//  the kernel counted so far, catches pulses shorter than polling period.
+//  Returns 0 on success, -1 on failure
+FTY_SENSOR_ENV_PRIVATE int
+    read_gpi_counters (libth_port_t *port, unsigned int *transitions);
+
+//  Wait up to timeout (ms) for change of GPI lines. Returns 0 when some
+//  could have changed, -1 when none did or on failure
+FTY_SENSOR_ENV_PRIVATE int
+    wait_gpi (libth_port_t *port, unsigned int timeout);
 //  @end
 
 #ifdef __cplusplus
@@ -0,0 +1,88 @@
+/*  =========================================================================
+    libth_sim - Simulated SHT1x sensor for libth
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef LIBTH_SIM_H_INCLUDED
+#define LIBTH_SIM_H_INCLUDED
+
+#define LIBTH_SIM_CONVERSION_14BIT  320 // ms, datasheet max time of conversions
+#define LIBTH_SIM_CONVERSION_12BIT  80
+#define LIBTH_SIM_CONVERSION_8BIT   20
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new simulated sensor, it is attached and reads 25 C, 52 %
+FTY_SENSOR_ENV_PRIVATE libth_sim_t *
+    libth_sim_new (void);
+
+//  Destroy the simulated sensor, ports attached to it must be closed
+FTY_SENSOR_ENV_PRIVATE void
+    libth_sim_destroy (libth_sim_t **self_p);
+
+//  Drive the port by the simulated sensor instead of serial device. Sensor
+//  isn't thread safe, it must be driven by one thread at a time
+FTY_SENSOR_ENV_PRIVATE void
+    libth_sim_attach (libth_sim_t *self, libth_port_t *port);
+
+//  Set whether port device exists and whether sensor is plugged in it
+FTY_SENSOR_ENV_PRIVATE void
+    libth_sim_set_present (libth_sim_t *self, bool port_exists, bool sensor_present);
+
+//  Set raw full resolution readings (14bit T, 12bit RH) sensor converts
+FTY_SENSOR_ENV_PRIVATE void
+    libth_sim_set_raw (libth_sim_t *self, int raw_T, int raw_H);
+
+//  Set state of GPI input (1, 2), changes are counted like the kernel does
+FTY_SENSOR_ENV_PRIVATE void
+    libth_sim_set_gpi (libth_sim_t *self, int gpi, int state);
+
+//  Set timing - latency (us) of each line access, the shortest half
+//  period (us) of SCK sensor reads correctly and conversion time
+//  in percent of datasheet maximum
+FTY_SENSOR_ENV_PRIVATE void
+    libth_sim_set_timing (libth_sim_t *self, unsigned int line_latency,
+        unsigned int min_half_period, unsigned int conversion_percent);
+
+//  Inject faults - corrupt every Nth conversion result after its CRC was
+//  computed, don't acknowledge every Nth command. Zero disables the fault
+FTY_SENSOR_ENV_PRIVATE void
+    libth_sim_set_faults (libth_sim_t *self, unsigned int corrupt_every, unsigned int nack_every);
+
+//  Return number of commands acknowledged so far
+FTY_SENSOR_ENV_PRIVATE unsigned int
+    libth_sim_commands (libth_sim_t *self);
+
+//  Return number of conversions done so far
+FTY_SENSOR_ENV_PRIVATE unsigned int
+    libth_sim_conversions (libth_sim_t *self);
+
+//  Self test of this class
+FTY_SENSOR_ENV_PRIVATE void
+    libth_sim_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif